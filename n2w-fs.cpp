@@ -6,6 +6,39 @@ using namespace std;
 using namespace experimental;
 using namespace n2w;
 
+// A directory_entry has no members to reflect, so columns of them go as
+// columns of this record of what the wire form of each carries.
+struct directory_record {
+  filesystem::path path;
+  bool exists = false;
+  uint32_t file_size = 0;
+  uint32_t hard_link_count = 0;
+  filesystem::file_time_type::duration time_since_epoch{};
+  filesystem::file_status symlink_status;
+
+  directory_record() = default;
+  directory_record(const filesystem::directory_entry &d) : path(d.path()) {
+    error_code ec;
+    exists = filesystem::exists(d, ec);
+    file_size = filesystem::file_size(path, ec);
+    hard_link_count = filesystem::hard_link_count(path, ec);
+    time_since_epoch = filesystem::last_write_time(path, ec).time_since_epoch();
+    symlink_status = d.symlink_status(ec);
+  }
+};
+N2W__BINARY_SPEC(directory_record,
+                 N2W__MEMBERS(path, exists, file_size, hard_link_count,
+                              time_since_epoch, symlink_status));
+N2W__JS_SPEC(directory_record,
+             N2W__MEMBERS(path, exists, file_size, hard_link_count,
+                          time_since_epoch, symlink_status));
+
+namespace n2w {
+template <> struct column_row<filesystem::directory_entry> {
+  using type = directory_record;
+};
+}
+
 auto current_working_directory() {
   error_code ec;
   return filesystem::current_path(ec);
@@ -220,18 +253,22 @@ auto temporary_directory_location() {
 
 plugin plugin = []() {
   n2w::plugin plugin;
-  plugin.register_service(N2W__DECLARE_API(current_working_directory), "");
+  plugin.register_service(N2W__DECLARE_API(current_working_directory), "",
+                          placement::inline_call);
   plugin.register_service(N2W__DECLARE_API(set_current_working_directory), "");
-  plugin.register_service(N2W__DECLARE_API(list_files), "");
+  plugin.register_service(N2W__DECLARE_API(list_files), "", columnar,
+                          placement::worker);
   plugin.register_service(N2W__DECLARE_API(convert_to_absolute_path), "");
   plugin.register_service(N2W__DECLARE_API(convert_to_canonical_path), "");
   // plugin.register_service(N2W__DECLARE_API(convert_to_relative_path), "");
   // plugin.register_service(N2W__DECLARE_API(convert_to_proximate_path), "");
-  plugin.register_service(N2W__DECLARE_API(copy_entity), "");
+  plugin.register_service(N2W__DECLARE_API(copy_entity), "",
+                          placement::worker);
   plugin.register_service(N2W__DECLARE_API(create_directory), "");
   plugin.register_service(N2W__DECLARE_API(create_hard_link), "");
   plugin.register_service(N2W__DECLARE_API(create_symbolic_link), "");
-  plugin.register_service(N2W__DECLARE_API(path_exists), "");
+  plugin.register_service(N2W__DECLARE_API(path_exists), "",
+                          placement::inline_call);
   plugin.register_service(N2W__DECLARE_API(paths_equivalent), "");
   plugin.register_service(N2W__DECLARE_API(file_size), "");
   plugin.register_service(N2W__DECLARE_API(hard_link_count), "");
@@ -239,11 +276,14 @@ plugin plugin = []() {
   plugin.register_service(N2W__DECLARE_API(set_last_write_time), "");
   plugin.register_service(N2W__DECLARE_API(set_permissions), "");
   plugin.register_service(N2W__DECLARE_API(get_symbolic_link_target), "");
-  plugin.register_service(N2W__DECLARE_API(remove_path), "");
+  plugin.register_service(N2W__DECLARE_API(remove_path), "",
+                          placement::worker);
   plugin.register_service(N2W__DECLARE_API(rename_path), "");
   plugin.register_service(N2W__DECLARE_API(resize_file), "");
-  plugin.register_service(N2W__DECLARE_API(space_information), "");
+  plugin.register_service(N2W__DECLARE_API(space_information), "",
+                          placement::worker);
   plugin.register_service(N2W__DECLARE_API(path_status), "");
-  plugin.register_service(N2W__DECLARE_API(temporary_directory_location), "");
+  plugin.register_service(N2W__DECLARE_API(temporary_directory_location), "",
+                          placement::inline_call);
   return plugin;
 }();
\ No newline at end of file
@@ -8,17 +8,24 @@
 #include <boost/preprocessor.hpp>
 #include <chrono>
 #include <complex>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
 #include <deque>
 #include <experimental/filesystem>
 #include <forward_list>
+#include <functional>
+#include <iterator>
 #include <list>
 #include <map>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <ratio>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
@@ -69,6 +76,21 @@ template <typename T> constexpr T reverse_endian(T t) {
   return t;
 }
 
+template <typename T>
+void reverse_endian_n(std::uint8_t *bytes, std::size_t count) {
+  for (auto end = bytes + count * sizeof(T); bytes != end; bytes += sizeof(T))
+    std::reverse(bytes, bytes + sizeof(T));
+}
+
+// Numbers travel little endian, which is what native-2-web.js reads, and are
+// swapped on hosts of the other order.
+constexpr bool little_endian_wire = true;
+constexpr bool little_endian_host =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+template <typename T>
+constexpr bool wire_swapped =
+    little_endian_host != little_endian_wire && sizeof(T) > 1;
+
 template <typename T> constexpr auto serial_size = sizeof(T);
 // template <> constexpr auto serial_size<void> = sizeof("void");
 // template <> constexpr auto serial_size<bool> = sizeof(std::uint8_t);
@@ -106,20 +128,279 @@ template <typename> constexpr bool is_heterogenous = false;
 template <typename T, typename U> constexpr bool is_heterogenous<pair<T, U>> = true;
 template <typename... Ts> constexpr bool is_heterogenous<tuple<Ts...>> = true;
 template <typename T, size_t N> constexpr bool is_heterogenous<array<T, N>> = true;
+
+template <typename> constexpr bool is_contiguous_container = false;
+template <typename T, typename... Ts> constexpr bool is_contiguous_container<vector<T, Ts...>> = !is_same_v<T, bool>;
+template <typename T, typename... Ts> constexpr bool is_contiguous_container<basic_string<T, Ts...>> = true;
 // clang-format on
 
+template <typename T> struct layout;
+
+// Thrown when a bounded_input runs out before what is read from it does.
+struct truncated_input : out_of_range {
+  truncated_input() : out_of_range{"Input ends before what it encodes"} {}
+};
+
+// A byte pointer that knows where its buffer ends, for decoding untrusted
+// input. The deserializers check it before every read, see need.
+class bounded_input {
+  const uint8_t *p = nullptr;
+  const uint8_t *end = nullptr;
+
+public:
+  using iterator_category = random_access_iterator_tag;
+  using value_type = uint8_t;
+  using difference_type = ptrdiff_t;
+  using pointer = const uint8_t *;
+  using reference = const uint8_t &;
+
+  bounded_input() = default;
+  bounded_input(const uint8_t *p, size_t size) : p(p), end(p + size) {}
+
+  size_t remaining() const { return end - p; }
+
+  reference operator*() const { return *p; }
+  reference operator[](difference_type n) const { return p[n]; }
+  bounded_input &operator++() { return *this += 1; }
+  bounded_input operator++(int) { return exchange(*this, *this + 1); }
+  bounded_input &operator+=(difference_type n) {
+    if (n > end - p)
+      throw truncated_input{};
+    p += n;
+    return *this;
+  }
+  bounded_input operator+(difference_type n) const {
+    return bounded_input{*this} += n;
+  }
+  difference_type operator-(const bounded_input &o) const { return p - o.p; }
+  bool operator==(const bounded_input &o) const { return p == o.p; }
+  bool operator!=(const bounded_input &o) const { return p != o.p; }
+};
+
+template <typename J> constexpr bool contiguous_input() {
+  using T = remove_cv_t<remove_reference_t<decltype(*declval<J>())>>;
+  if constexpr (is_pointer_v<J> || is_same_v<J, bounded_input>)
+    return true;
+  else if constexpr (is_same_v<T, bool> ||
+                     !(is_arithmetic_v<T> || layout<T>::fixed))
+    return false;
+  else if constexpr (is_same_v<J, typename vector<T>::iterator> ||
+                     is_same_v<J, typename vector<T>::const_iterator>)
+    return true;
+  else if constexpr (is_same_v<T, char> || is_same_v<T, wchar_t> ||
+                     is_same_v<T, char16_t> || is_same_v<T, char32_t>)
+    return is_same_v<J, typename basic_string<T>::iterator> ||
+           is_same_v<J, typename basic_string<T>::const_iterator>;
+  else
+    return false;
+}
+template <typename J> constexpr bool is_contiguous_input = contiguous_input<J>();
+
+// Hands out raw storage for n elements at an output iterator, advancing it.
+template <typename I> struct contiguous_output : false_type {
+  using value_type = void;
+};
+template <typename T> struct contiguous_output<T *> : true_type {
+  using value_type = T;
+  static T *claim(T *&i, size_t n) { return exchange(i, i + n); }
+};
+template <typename C>
+struct contiguous_output<back_insert_iterator<C>>
+    : bool_constant<is_contiguous_container<C>> {
+  using value_type = typename C::value_type;
+  static value_type *claim(back_insert_iterator<C> &i, size_t n) {
+    struct access : back_insert_iterator<C> {
+      static C &of(back_insert_iterator<C> &i) {
+        return *(i.*&access::container);
+      }
+    };
+    auto &c = access::of(i);
+    auto size = c.size();
+    c.resize(size + n);
+    return &c[size];
+  }
+};
+template <typename I, typename T>
+constexpr bool is_contiguous_output =
+    contiguous_output<I>::value &&
+    is_same_v<remove_cv_t<typename contiguous_output<I>::value_type>, T>;
+
+// Read-only view of a run of numbers as laid out on the wire, aliasing the
+// buffer it was deserialized from. Elements are loaded by value, so the
+// buffer needs no particular alignment.
+template <typename T> class numbers_view {
+  static_assert(is_arithmetic<T>::value, "Not an arithmetic type");
+
+  const uint8_t *bytes = nullptr;
+  size_t count = 0;
+
+  static T load(const uint8_t *p) {
+    T t;
+    memcpy(&t, p, sizeof(T));
+    if constexpr (wire_swapped<T>)
+      t = reverse_endian(t);
+    return t;
+  }
+
+public:
+  class const_iterator {
+    const uint8_t *p = nullptr;
+    friend class numbers_view;
+    const_iterator(const uint8_t *p) : p(p) {}
+
+  public:
+    using iterator_category = random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = ptrdiff_t;
+    using pointer = void;
+    using reference = T;
+
+    const_iterator() = default;
+    T operator*() const { return load(p); }
+    T operator[](difference_type n) const { return load(p + n * sizeof(T)); }
+    const_iterator &operator++() { return *this += 1; }
+    const_iterator &operator--() { return *this -= 1; }
+    const_iterator operator++(int) { return exchange(*this, *this + 1); }
+    const_iterator operator--(int) { return exchange(*this, *this - 1); }
+    const_iterator &operator+=(difference_type n) {
+      p += n * difference_type(sizeof(T));
+      return *this;
+    }
+    const_iterator &operator-=(difference_type n) { return *this += -n; }
+    const_iterator operator+(difference_type n) const {
+      return const_iterator{*this} += n;
+    }
+    const_iterator operator-(difference_type n) const { return *this + -n; }
+    difference_type operator-(const_iterator o) const {
+      return (p - o.p) / difference_type(sizeof(T));
+    }
+    bool operator==(const_iterator o) const { return p == o.p; }
+    bool operator!=(const_iterator o) const { return p != o.p; }
+    bool operator<(const_iterator o) const { return p < o.p; }
+  };
+  using value_type = T;
+  using size_type = size_t;
+  using iterator = const_iterator;
+
+  numbers_view() = default;
+  numbers_view(const uint8_t *bytes, size_t count)
+      : bytes(bytes), count(count) {}
+
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+  const uint8_t *data() const { return bytes; }
+  T operator[](size_t n) const { return load(bytes + n * sizeof(T)); }
+  const_iterator begin() const { return {bytes}; }
+  const_iterator end() const { return {bytes + count * sizeof(T)}; }
+
+  operator vector<T>() const { return {begin(), end()}; }
+};
+
+// An argument streamed to a service in chunks, which may be longer than a
+// message and than memory. The connection feeds chunks as they arrive and the
+// service takes their bytes with read_some, which waits for some to arrive
+// and returns 0 once all size() bytes were read or the stream was aborted.
+// on_read hears of the bytes read, and of those dropped by abort, so that the
+// feeder can keep what is buffered within a window.
+class byte_source {
+  mutable mutex guard;
+  condition_variable arrived;
+  deque<pair<vector<uint8_t>, size_t>> chunks;
+  uint64_t length;
+  uint64_t fed = 0;
+  bool aborted_ = false;
+  function<void(size_t)> on_read;
+
+public:
+  byte_source(uint64_t length, function<void(size_t)> on_read)
+      : length(length), on_read(move(on_read)) {}
+  byte_source(const byte_source &) = delete;
+
+  uint64_t size() const { return length; }
+
+  bool aborted() const {
+    lock_guard<mutex> lock{guard};
+    return aborted_;
+  }
+
+  size_t read_some(uint8_t *data, size_t size) {
+    unique_lock<mutex> lock{guard};
+    arrived.wait(lock, [this] {
+      return !chunks.empty() || aborted_ || fed == length;
+    });
+    size_t copied = 0;
+    while (copied < size && !chunks.empty()) {
+      auto &chunk = chunks.front();
+      auto n = min(size - copied, chunk.first.size() - chunk.second);
+      memcpy(data + copied, chunk.first.data() + chunk.second, n);
+      copied += n;
+      if ((chunk.second += n) == chunk.first.size())
+        chunks.pop_front();
+    }
+    lock.unlock();
+    if (copied)
+      on_read(copied);
+    return copied;
+  }
+
+  // Queues the bytes of a chunk from offset on, past which the stream takes
+  // no more than size() in all, and returns how many it keeps. An aborted
+  // stream keeps none.
+  size_t feed(vector<uint8_t> chunk, size_t offset) {
+    lock_guard<mutex> lock{guard};
+    auto bytes = static_cast<size_t>(
+        min<uint64_t>(chunk.size() - min(offset, chunk.size()), length - fed));
+    fed += bytes;
+    if (bytes && !aborted_) {
+      chunk.resize(offset + bytes);
+      chunks.emplace_back(move(chunk), offset);
+    }
+    arrived.notify_all();
+    return aborted_ ? 0 : bytes;
+  }
+
+  // Whether every byte of the stream was fed.
+  bool filled() const {
+    lock_guard<mutex> lock{guard};
+    return fed == length;
+  }
+
+  // Drops the bytes not read yet, wakes the reader and returns how many
+  // were dropped. Later chunks are counted but not kept.
+  size_t abort() {
+    lock_guard<mutex> lock{guard};
+    aborted_ = true;
+    size_t dropped = 0;
+    for (auto &chunk : chunks)
+      dropped += chunk.first.size() - chunk.second;
+    chunks.clear();
+    arrived.notify_all();
+    return dropped;
+  }
+};
+
+// Member pointers and names of a structure, see N2W__SPECIALIZE_STRUCTURE.
+template <typename S> struct reflection;
+
 template <typename S, typename M, typename B> struct structure;
 
+// Views an S through its reflection. The member pointers are compile time
+// constants, so member access folds down to plain field access.
 template <typename S, typename T, typename... Ts, typename... Bs>
 struct structure<S, tuple<T, Ts...>, tuple<Bs...>> {
-  const volatile union {
-    S *const volatile s_write;
-    const S *const volatile s_read;
-  };
-  static const tuple<T S::*, Ts S::*...> members;
-  static vector<string> names();
-  static vector<string> base_names();
-  structure(S *s) : s_write(s) {}
+  S *const s_write = nullptr;
+  const S *const s_read;
+  static const vector<string> &names() {
+    static const vector<string> names{cbegin(reflection<S>::names),
+                                      cend(reflection<S>::names)};
+    return names;
+  }
+  static const vector<string> &base_names() {
+    static const vector<string> base_names{cbegin(reflection<S>::base_names),
+                                           cend(reflection<S>::base_names)};
+    return base_names;
+  }
+  structure(S *s) : s_write(s), s_read(s) {}
   structure(const S *s) : s_read(s) {}
   structure(nullptr_t) = delete;
   structure(int) = delete;
@@ -134,12 +415,12 @@ struct structure<S, tuple<T, Ts...>, tuple<Bs...>> {
 
 template <size_t N, typename S, typename T, typename... Ts, typename... Bs>
 auto &get(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &s) {
-  return s.s_read->*get<N>(s.members);
+  return s.s_read->*get<N>(reflection<S>::members);
 }
 
 template <size_t N, typename S, typename T, typename... Ts, typename... Bs>
 auto &get(structure<S, tuple<T, Ts...>, tuple<Bs...>> &s) {
-  return s.s_write->*get<N>(s.members);
+  return s.s_write->*get<N>(reflection<S>::members);
 }
 
 template <typename S, typename T, typename... Ts, typename... Bs, size_t... Is>
@@ -249,8 +530,8 @@ template <size_t N, typename T, size_t S> const char *at(const array<T, S> &) {
 }
 
 template <size_t N, typename S, typename T, typename... Ts, typename... Bs>
-string at(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &s) {
-  auto m_p = get<N>(s.members);
+string at(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &) {
+  auto m_p = get<N>(reflection<S>::members);
   return '@' + to_string(*reinterpret_cast<uintptr_t *>(&m_p));
 }
 
@@ -270,14 +551,246 @@ template <size_t N, typename T, size_t S> string name(const array<T, S> &) {
 }
 
 template <size_t N, typename S, typename T, typename... Ts, typename... Bs>
-string name(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &s) {
-  return s.names()[N + 1];
+const char *name(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &) {
+  return reflection<S>::names[N + 1];
+}
+
+// Where the wire image of a fixed layout value sits in its object, as runs of
+// (offset, size) in wire order. Such values are copied with a handful of
+// memcpys instead of a walk over their members. Numbers, enums, fixed arrays,
+// pairs, tuples and structures made only of those are fixed layout, except
+// scalar char16_t and wchar_t, which are transcoded. Big endian hosts swap
+// every number on the way, so they always take the long way.
+struct layout_plan {
+  vector<pair<size_t, size_t>> runs;
+  size_t size = 0;
+  bool dense = false; // The wire image is the whole object.
+
+  void add(const void *origin, const void *p, size_t n) {
+    size_t offset =
+        static_cast<const uint8_t *>(p) - static_cast<const uint8_t *>(origin);
+    if (!runs.empty() && runs.back().first + runs.back().second == offset)
+      runs.back().second += n;
+    else
+      runs.emplace_back(offset, n);
+    size += n;
+  }
+
+  // Copies the wire image of one value out of its object.
+  uint8_t *gather(const uint8_t *object, uint8_t *wire) const {
+    for (auto run = runs.data(), end = run + runs.size(); run != end; ++run) {
+      copy(wire, object + run->first, run->second);
+      wire += run->second;
+    }
+    return wire;
+  }
+  // Copies the wire image of one value into its object.
+  const uint8_t *scatter(const uint8_t *wire, uint8_t *object) const {
+    for (auto run = runs.data(), end = run + runs.size(); run != end; ++run) {
+      copy(object + run->first, wire, run->second);
+      wire += run->second;
+    }
+    return wire;
+  }
+
+  // Runs are mostly a few numbers long, so copy them as two overlapping fixed
+  // size words rather than calling out to memcpy.
+  static void copy(uint8_t *to, const uint8_t *from, size_t n) {
+    if (n > 16)
+      memcpy(to, from, n);
+    else if (n >= 8) {
+      memcpy(to, from, 8);
+      memcpy(to + n - 8, from + n - 8, 8);
+    } else if (n >= 4) {
+      memcpy(to, from, 4);
+      memcpy(to + n - 4, from + n - 4, 4);
+    } else if (n >= 2) {
+      memcpy(to, from, 2);
+      memcpy(to + n - 2, from + n - 2, 2);
+    } else if (n)
+      *to = *from;
+  }
+};
+
+template <typename> constexpr bool is_std_array = false;
+template <typename T, size_t N> constexpr bool is_std_array<array<T, N>> = true;
+
+// Numbers inside arrays go out raw, see serialize_numbers.
+template <typename T> constexpr bool fixed_layout_element() {
+  return is_arithmetic_v<T> || layout<T>::fixed;
+}
+
+template <typename T, size_t... Is>
+constexpr bool fixed_layout_heterogenous(index_sequence<Is...>) {
+  return (true && ... && layout<tuple_element_t<Is, T>>::fixed);
+}
+
+template <typename T> constexpr bool fixed_layout() {
+  if constexpr (little_endian_host != little_endian_wire ||
+                is_same_v<T, char16_t> || is_same_v<T, wchar_t>)
+    return false;
+  else if constexpr (is_arithmetic_v<T> || is_enum_v<T>)
+    return true;
+  else if constexpr (is_array_v<T>)
+    return fixed_layout_element<remove_all_extents_t<T>>();
+  else if constexpr (is_std_array<T>)
+    return fixed_layout_element<typename T::value_type>();
+  else if constexpr (is_heterogenous<T>)
+    return fixed_layout_heterogenous<T>(make_index_sequence<tuple_size_v<T>>{});
+  else
+    return false;
+}
+
+template <typename T> struct layout {
+  static constexpr bool fixed = fixed_layout<remove_cv_t<T>>();
+
+  template <size_t... Is>
+  static void plan_heterogenous(const T &t, const void *origin, layout_plan &p,
+                                index_sequence<Is...>) {
+    (layout<tuple_element_t<Is, T>>::plan(get<Is>(t), origin, p), ...);
+  }
+  static void plan(const T &t, const void *origin, layout_plan &p) {
+    if constexpr (!fixed)
+      ;
+    else if constexpr (is_array_v<T> || is_std_array<remove_cv_t<T>>) {
+      using E = remove_cv_t<remove_reference_t<decltype(t[0])>>;
+      if constexpr (is_arithmetic_v<remove_all_extents_t<E>>)
+        p.add(origin, &t, sizeof(T));
+      else
+        for (auto &e : t)
+          layout<E>::plan(e, origin, p);
+    } else if constexpr (is_heterogenous<remove_cv_t<T>>)
+      plan_heterogenous(t, origin, p, make_index_sequence<tuple_size_v<T>>{});
+    else
+      p.add(origin, &t, sizeof(T));
+  }
+};
+
+template <typename S, typename T, typename... Ts, typename... Bs>
+struct layout<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
+  static constexpr bool fixed =
+      (layout<Bs>::fixed && ... && layout<T>::fixed) &&
+      (true && ... && layout<Ts>::fixed);
+
+  template <size_t... Is>
+  static void plan_members(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &t,
+                           const void *origin, layout_plan &p,
+                           index_sequence<Is...>) {
+    (layout<remove_cv_t<remove_reference_t<decltype(get<Is>(t))>>>::plan(
+         get<Is>(t), origin, p),
+     ...);
+  }
+  static void plan(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &t,
+                   const void *origin, layout_plan &p) {
+    if constexpr (fixed) {
+      (layout<Bs>::plan(*static_cast<const Bs *>(t.s_read), origin, p), ...);
+      plan_members(t, origin, p, make_index_sequence<sizeof...(Ts) + 1>{});
+    }
+  }
+};
+
+// Worked out once per type, on a value initialized T.
+template <typename T> const layout_plan &fixed_layout_plan() {
+  static_assert(layout<T>::fixed, "Not a fixed layout type");
+  static const layout_plan plan = [] {
+    layout_plan p;
+    T t{};
+    layout<T>::plan(t, &t, p);
+    p.dense = is_trivially_copyable_v<T> && p.runs.size() == 1 &&
+              p.size == sizeof(T);
+    return p;
+  }();
+  return plan;
+}
+
+template <typename T, typename = void> constexpr bool is_reflected = false;
+template <typename T>
+constexpr bool is_reflected<T, void_t<typename reflection<T>::view>> = true;
+
+// A vector of structures, pairs or tuples that goes on the wire by column
+// instead of by row, see for_each_column.
+template <typename T> struct columns : vector<T> {
+  using vector<T>::vector;
+  columns() = default;
+  columns(vector<T> rows) : vector<T>(move(rows)) {}
+};
+
+template <typename T, typename P, typename V>
+void for_each_column(P project, V &v);
+
+template <typename B, typename D> auto &base_of(D &d) {
+  return static_cast<conditional_t<is_const_v<D>, const B, B> &>(d);
+}
+
+template <typename T> struct structure_columns;
+template <typename S, typename... Ts, typename... Bs>
+struct structure_columns<structure<S, tuple<Ts...>, tuple<Bs...>>> {
+  template <typename P, typename V, size_t... Is>
+  static void visit(P project, V &v, index_sequence<Is...>) {
+    (for_each_column<Bs>(
+         [project](auto &r) -> auto & { return base_of<Bs>(project(r)); }, v),
+     ...);
+    (for_each_column<remove_cv_t<Ts>>(
+         [project](auto &r) -> auto & {
+           return project(r).*get<Is>(reflection<S>::members);
+         },
+         v),
+     ...);
+  }
+};
+
+template <typename T, typename P, typename V, size_t... Is>
+void for_each_element_column(P project, V &v, index_sequence<Is...>) {
+  (for_each_column<tuple_element_t<Is, T>>(
+       [project](auto &r) -> auto & { return get<Is>(project(r)); }, v),
+   ...);
+}
+
+// Hands every column of a T to v.template column<F>(project), in wire order.
+// Structures split into their bases and members and pairs and tuples into
+// their elements, down to fields of any other type F. project maps a row to
+// its F.
+template <typename T, typename P, typename V>
+void for_each_column(P project, V &v) {
+  if constexpr (is_reflected<T>)
+    structure_columns<typename reflection<T>::view>::visit(
+        project, v, make_index_sequence<tuple_size_v<
+                        decay_t<decltype(reflection<T>::members)>>>{});
+  else if constexpr (is_heterogenous<T> && !is_std_array<T>)
+    for_each_element_column<T>(project, v,
+                               make_index_sequence<tuple_size_v<T>>{});
+  else
+    v.template column<T>(project);
 }
 
+// Numbers in a column travel as they do in a sequence, enums as their
+// underlying type, and char16_t and wchar_t as code points, as in rows.
+template <typename T, typename = void> struct column_number {
+  using type = T;
+};
+template <typename T> struct column_number<T, enable_if_t<is_enum_v<T>>> {
+  using type = underlying_type_t<T>;
+};
+template <> struct column_number<char16_t> { using type = char32_t; };
+template <> struct column_number<wchar_t> { using type = char32_t; };
+template <typename T> using column_number_t = typename column_number<T>::type;
+
+// Strings in a column travel as their end offsets followed by their UTF-8.
+template <typename> constexpr bool is_string_column = false;
+template <typename T, typename... Traits>
+constexpr bool is_string_column<basic_string<T, Traits...>> = true;
+
+// Number columns start at a multiple of their element size from the start of
+// the columns so that readers can view them in place.
+template <typename T> constexpr size_t column_padding(size_t offset) {
+  return (sizeof(T) - offset % sizeof(T)) % sizeof(T);
+}
+
+// Specialized by N2W__SPECIALIZE_ENUM. The tables are built on first use.
 template <typename E> struct enumeration {
-  static string type_name();
-  static map<E, string> e_to_str();
-  static unordered_map<string, E> str_to_e();
+  static const char *type_name();
+  static const map<E, string> &e_to_str();
+  static const unordered_map<string, E> &str_to_e();
 };
 
 template <size_t I, typename T>
@@ -289,7 +802,25 @@ using common_detail::is_sequence;
 using common_detail::is_pushback_sequence;
 using common_detail::is_associative;
 using common_detail::is_heterogenous;
+using common_detail::is_std_array;
+using common_detail::is_contiguous_input;
+using common_detail::is_contiguous_output;
+using common_detail::contiguous_output;
+using common_detail::layout;
+using common_detail::layout_plan;
+using common_detail::fixed_layout_plan;
+using common_detail::reflection;
+using common_detail::is_reflected;
+using common_detail::columns;
+using common_detail::for_each_column;
+using common_detail::column_number_t;
+using common_detail::is_string_column;
+using common_detail::column_padding;
 using common_detail::structure;
+using common_detail::numbers_view;
+using common_detail::byte_source;
+using common_detail::bounded_input;
+using common_detail::truncated_input;
 using common_detail::enumeration;
 using common_detail::element_t;
 using common_detail::name;
@@ -311,17 +842,23 @@ using common_detail::get;
   BOOST_PP_COMMA_IF(i) BOOST_PP_STRINGIZE(elem)
 #define N2W__MEMBER_NAMES(m) BOOST_PP_SEQ_FOR_EACH_I(N2W__MEM_NAME, _, m)
 #define N2W__SPECIALIZE_STRUCTURE(s, m, ...)                                   \
-  template <>                                                                  \
-  const decltype(N2W__MAKE_MEMBER_TUPLE(s, m)) N2W__USING_STRUCTURE(           \
-      s, m, __VA_ARGS__)::members = N2W__MAKE_MEMBER_TUPLE(s, m);              \
-  template <>                                                                  \
-  std::vector<std::string> N2W__USING_STRUCTURE(s, m, __VA_ARGS__)::names() {  \
-    return {#s, N2W__MEMBER_NAMES(m)};                                         \
-  }                                                                            \
-  template <>                                                                  \
-  std::vector<std::string> N2W__USING_STRUCTURE(s, m,                          \
-                                                __VA_ARGS__)::base_names() {   \
-    return {N2W__MEMBER_NAMES(BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__))};         \
+  namespace n2w {                                                              \
+  template <> struct reflection<s> {                                           \
+    using view = N2W__USING_STRUCTURE(s, m, __VA_ARGS__);                      \
+    static constexpr auto members = N2W__MAKE_MEMBER_TUPLE(s, m);              \
+    static constexpr const char *names[] = {#s, N2W__MEMBER_NAMES(m)};         \
+    static constexpr const char *base_names[] = {                              \
+        N2W__MEMBER_NAMES(BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__))};             \
+  };                                                                           \
+  template <> struct layout<s> {                                               \
+    static constexpr bool fixed =                                              \
+        std::is_default_constructible<s>{} &&                                  \
+        layout<N2W__USING_STRUCTURE(s, m, __VA_ARGS__)>::fixed;                \
+    static void plan(const s &_s, const void *origin, layout_plan &p) {        \
+      N2W__CONSTRUCTOR(s, m, _s, __VA_ARGS__);                                 \
+      layout<decltype(_s_v)>::plan(_s_v, origin, p);                           \
+    }                                                                          \
+  };                                                                           \
   }
 #define N2W__CONSTRUCTOR(s, m, o, ...)                                         \
   N2W__USING_STRUCTURE(s, m, __VA_ARGS__) o##_v { &o }
@@ -334,13 +871,18 @@ using common_detail::get;
 #define N2W__STRING_TO_ENUM(m) BOOST_PP_SEQ_FOR_EACH_I(N2W__S_E_PAIR, _, m)
 #define N2W__SPECIALIZE_ENUM(e, m)                                             \
   template <> struct n2w::mangle<e> : n2w::mangle<enumeration<e>> {};          \
-  template <> std::string n2w::enumeration<e>::type_name() { return #e; }      \
-  template <> std::map<e, std::string> n2w::enumeration<e>::e_to_str() {       \
-    return {N2W__ENUM_TO_STRING(m)};                                           \
+  template <> const char *n2w::enumeration<e>::type_name() { return #e; }     \
+  template <>                                                                  \
+  const std::map<e, std::string> &n2w::enumeration<e>::e_to_str() {           \
+    static const std::map<e, std::string> e_to_str = {N2W__ENUM_TO_STRING(m)}; \
+    return e_to_str;                                                           \
   }                                                                            \
   template <>                                                                  \
-  std::unordered_map<std::string, e> n2w::enumeration<e>::str_to_e() {         \
-    return {N2W__STRING_TO_ENUM(m)};                                           \
+  const std::unordered_map<std::string, e> &                                   \
+  n2w::enumeration<e>::str_to_e() {                                            \
+    static const std::unordered_map<std::string, e> str_to_e = {               \
+        N2W__STRING_TO_ENUM(m)};                                               \
+    return str_to_e;                                                           \
   }
 }
 
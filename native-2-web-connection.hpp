@@ -11,12 +11,28 @@ inline bool operator!=(boost::system::error_code ec, int i) { return ec != i; }
 #include <boost/asio.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/preprocessor.hpp>
+#include <boost/version.hpp>
 #define BOOST_COROUTINES_NO_DEPRECATION_WARNING 1
 #define BOOST_COROUTINES_V2 1
 #include <boost/asio/spawn.hpp>
 
+#include "native-2-web-common.hpp"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <experimental/filesystem>
+#include <list>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <variant>
 
 namespace n2w {
 
@@ -28,6 +44,742 @@ using namespace beast;
 
 template <typename> class client_connection;
 
+// Bytes held for connections, by what holds them: the connection objects,
+// read buffers, replies queued to write and streamed arguments not yet read.
+// Coroutine stacks are counted by stack_pool.
+struct connection_memory {
+  static inline atomic_size_t connections{0};
+  static inline atomic_size_t objects{0};
+  static inline atomic_size_t read_buffers{0};
+  static inline atomic_size_t queued_replies{0};
+  static inline atomic_size_t streamed_arguments{0};
+};
+
+// A DynamicBuffer over one flat vector. Reads land in place, and a finished
+// binary message is handed on by moving the vector out rather than copying.
+// Storage is only allocated as reads need it and can be dropped once empty,
+// so an idle connection holds none.
+class message_buffer {
+  vector<uint8_t> storage;
+  size_t first = 0;
+  size_t last = 0;
+
+  void account(size_t capacity) {
+    connection_memory::read_buffers += storage.capacity() - capacity;
+  }
+
+public:
+  message_buffer() = default;
+  message_buffer(const message_buffer &) = delete;
+  ~message_buffer() { connection_memory::read_buffers -= storage.capacity(); }
+
+  using const_buffers_type = const_buffers_1;
+  using mutable_buffers_type = mutable_buffers_1;
+
+  size_t size() const { return last - first; }
+  size_t max_size() const { return storage.max_size(); }
+  size_t capacity() const { return storage.size() - first; }
+
+  const_buffers_type data() const { return {storage.data() + first, size()}; }
+
+  mutable_buffers_type prepare(size_t n) {
+    if (storage.size() - last < n && first) {
+      copy(cbegin(storage) + first, cbegin(storage) + last, begin(storage));
+      last -= first;
+      first = 0;
+    }
+    if (storage.size() - last < n) {
+      auto capacity = storage.capacity();
+      storage.resize(max(last + n, 2 * storage.size()));
+      account(capacity);
+    }
+    return {storage.data() + last, n};
+  }
+
+  void commit(size_t n) { last += min(n, storage.size() - last); }
+
+  void consume(size_t n) {
+    first += min(n, size());
+    if (first == last)
+      first = last = 0;
+  }
+
+  // Takes the readable bytes and leaves the buffer empty.
+  vector<uint8_t> release() {
+    vector<uint8_t> bytes;
+    storage.resize(last);
+    storage.erase(cbegin(storage), cbegin(storage) + first);
+    bytes.swap(storage);
+    account(bytes.capacity());
+    first = last = 0;
+    return bytes;
+  }
+
+  // Frees the storage if nothing is left to read.
+  void trim() {
+    if (size() || !storage.capacity())
+      return;
+    auto capacity = storage.capacity();
+    vector<uint8_t>{}.swap(storage);
+    first = last = 0;
+    account(capacity);
+  }
+};
+
+// Coroutine stacks, mapped with a guard page below each. A finished
+// coroutine's stack goes on a free list of the thread it finished on, up to
+// `cap` stacks per size, and the next coroutine of that size spawned there
+// takes it instead of mapping a new one. With `prefault` set, new stacks are
+// populated up front rather than page by page.
+class stack_pool {
+  struct free_lists {
+    unordered_map<size_t, vector<void *>> stacks;
+    ~free_lists() {
+      for (auto &sized : stacks)
+        for (auto sp : sized.second)
+          unmap(sp, sized.first);
+    }
+  };
+
+  static free_lists &local() {
+    thread_local free_lists lists;
+    return lists;
+  }
+
+  static size_t page_size() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+  }
+
+  static void unmap(void *sp, size_t size) {
+    munmap(static_cast<char *>(sp) - size, size);
+    unmapped(size);
+  }
+
+  static void mapped(size_t size) {
+    mapped_bytes += size;
+    auto now = ++live;
+    for (auto top = high_water.load();
+         top < now && !high_water.compare_exchange_weak(top, now);)
+      ;
+  }
+  static void unmapped(size_t size) {
+    --live;
+    mapped_bytes -= size;
+  }
+
+public:
+  static inline atomic_size_t cap{64};
+  static inline atomic_bool prefault{false};
+
+  static inline atomic_size_t hits{0};
+  static inline atomic_size_t misses{0};
+  static inline atomic_size_t live{0};
+  static inline atomic_size_t high_water{0};
+  static inline atomic_size_t mapped_bytes{0};
+
+  // A StackAllocator for boost::coroutines.
+  struct allocator {
+    void allocate(boost::coroutines::stack_context &sctx, size_t size) {
+      size = (size + page_size() - 1) / page_size() * page_size() + page_size();
+      sctx.size = size;
+      auto &stacks = local().stacks[size];
+      if (!stacks.empty()) {
+        ++hits;
+        sctx.sp = stacks.back();
+        stacks.pop_back();
+        return;
+      }
+      ++misses;
+      auto limit = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS |
+                            (prefault ? MAP_POPULATE : 0),
+                        -1, 0);
+      if (limit == MAP_FAILED)
+        throw bad_alloc{};
+      mprotect(limit, page_size(), PROT_NONE);
+      sctx.sp = static_cast<char *>(limit) + size;
+      mapped(size);
+    }
+
+    void deallocate(boost::coroutines::stack_context &sctx) {
+      auto &stacks = local().stacks[sctx.size];
+      if (stacks.size() < cap)
+        stacks.push_back(sctx.sp);
+      else
+        unmap(sctx.sp, sctx.size);
+    }
+  };
+
+  // Counts a stack the coroutine library allocates itself, for spawns that
+  // cannot take theirs from the pool, as a miss while it lives.
+  struct unpooled {
+    size_t size;
+    explicit unpooled(size_t size) : size{size} {
+      ++misses;
+      mapped(size);
+    }
+    unpooled(const unpooled &) = delete;
+    ~unpooled() { unmapped(size); }
+  };
+};
+
+// Memory for connection objects. A freed block goes on a free list of the
+// thread that frees it, up to `cap` blocks per size, and the next connection
+// of that size made there takes it. The blocks in use count as
+// connection_memory::objects.
+class connection_pool {
+  static unordered_map<size_t, vector<void *>> &local() {
+    struct free_lists {
+      unordered_map<size_t, vector<void *>> blocks;
+      ~free_lists() {
+        for (auto &sized : blocks)
+          for (auto block : sized.second)
+            ::operator delete(block);
+      }
+    };
+    thread_local free_lists lists;
+    return lists.blocks;
+  }
+
+public:
+  static inline atomic_size_t cap{1024};
+
+  static inline atomic_size_t hits{0};
+  static inline atomic_size_t misses{0};
+
+  static void *take(size_t size) {
+    connection_memory::objects += size;
+    auto &blocks = local()[size];
+    if (blocks.empty()) {
+      ++misses;
+      return ::operator new(size);
+    }
+    ++hits;
+    auto block = blocks.back();
+    blocks.pop_back();
+    return block;
+  }
+
+  static void give(void *block, size_t size) {
+    connection_memory::objects -= size;
+    auto &blocks = local()[size];
+    if (blocks.size() < cap)
+      blocks.push_back(block);
+    else
+      ::operator delete(block);
+  }
+
+  // An Allocator for allocate_shared.
+  template <typename T> struct allocator {
+    using value_type = T;
+
+    allocator() = default;
+    template <typename U> allocator(const allocator<U> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(take(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) { give(p, n * sizeof(T)); }
+
+    template <typename U> bool operator==(const allocator<U> &) const {
+      return true;
+    }
+    template <typename U> bool operator!=(const allocator<U> &) const {
+      return false;
+    }
+  };
+};
+
+// Passed to spawn in place of boost::coroutines::attributes to take the
+// coroutine stack from stack_pool.
+struct pooled_stack {
+  size_t size;
+};
+
+// Asio's spawn takes no stack allocator, only the size of the stack, so
+// spawning on a pooled stack leans on the internals of its coroutine based
+// spawn. Those held still from Boost 1.54 until 1.66 moved yield_context onto
+// executors, so stacks are pooled with Boost 1.54 to 1.65. Other releases, and
+// builds defining N2W__STOCK_SPAWN, spawn as Asio does with a stack of the
+// size asked for, or the least the coroutine library allows. The stacks are
+// then not pooled, and stack_pool only counts them, each as a miss of the
+// size asked for, and says so once.
+#ifdef N2W__POOLED_SPAWN
+template <typename Handler, typename Function> struct pooled_spawn_helper {
+  shared_ptr<boost::asio::detail::spawn_data<Handler, Function>> data;
+  boost::coroutines::attributes attributes;
+
+  void operator()() {
+    using callee_type = typename basic_yield_context<Handler>::callee_type;
+    boost::asio::detail::coro_entry_point<Handler, Function> entry_point = {
+        data};
+    shared_ptr<callee_type> coro{
+        new callee_type(entry_point, attributes, stack_pool::allocator{})};
+    data->coro_ = coro;
+    (*coro)();
+  }
+};
+
+template <typename Function>
+void spawn(io_service::strand strand, Function &&function, pooled_stack stack) {
+  auto handler = strand.wrap(&boost::asio::detail::default_spawn_handler);
+  using handler_type = decltype(handler);
+  using function_type = decay_t<Function>;
+  pooled_spawn_helper<handler_type, function_type> helper;
+  helper.data.reset(
+      new boost::asio::detail::spawn_data<handler_type, function_type>(
+          move(handler), true, forward<Function>(function)));
+  helper.attributes = boost::coroutines::attributes{stack.size};
+  strand.dispatch(move(helper));
+}
+#else
+template <typename Function>
+void spawn(io_service::strand strand, Function &&function, pooled_stack stack) {
+  static once_flag told;
+  call_once(told, [] {
+    clog << "Boost " << BOOST_LIB_VERSION << " spawns coroutines on stacks "
+         << "of its own: stack_pool only counts them.\n";
+  });
+  auto size = max(stack.size, boost::coroutines::stack_traits::minimum_size());
+  boost::asio::spawn(strand,
+                     [ function = forward<Function>(function),
+                       size ](auto yield) mutable {
+                       stack_pool::unpooled counted{size};
+                       function(yield);
+                     },
+                     boost::coroutines::attributes{size});
+}
+#endif
+
+template <typename Function>
+void spawn(io_service &service, Function &&function, pooled_stack stack) {
+  spawn(io_service::strand{service}, forward<Function>(function), stack);
+}
+
+// Limits on the work a connection may have in hand: calls started and not
+// answered, bar those reading a streamed argument, whose chunks must keep
+// coming, bytes of replies queued and not written, and bytes of streamed
+// arguments received and not read by their services. A websocket stops
+// reading while any is reached, which leaves the client's frames in the
+// socket for TCP flow control to hold back. Calls already running still
+// queue their replies, so bytes can pass their limit by that much. Zero lifts
+// a limit.
+struct flow_limits {
+  static inline atomic_size_t max_in_flight{256};
+  static inline atomic_size_t max_outbound_bytes{16 << 20};
+  static inline atomic_size_t max_streamed_bytes{4 << 20};
+};
+
+// How many websocket frames ready at once the writer of a server connection
+// gathers into one write, and how long it waits for more to join them.
+struct write_batching {
+  static inline atomic_size_t max_frames{64};
+  static inline atomic<chrono::microseconds> max_delay{chrono::microseconds{0}};
+};
+
+// Replies over fragment_bytes go out a fragment at a time, for handlers that
+// tag replies and can split them, and replies of at most urgent_bytes go out
+// before any other queued reply. Whole replies and the fragments of large
+// ones take turns, so neither class waits on the other for long. Zero turns
+// either off.
+struct reply_fragmenting {
+  static inline atomic_size_t fragment_bytes{64 << 10};
+  static inline atomic_size_t urgent_bytes{4 << 10};
+};
+
+// How long a server connection may take to send its first request and have
+// its websocket accepted, to start its next request or websocket message while
+// it has no calls running, to send the rest of a request once it started, and
+// to take a write. A connection that runs out of time is shut down. Zero
+// turns a timeout off.
+struct connection_timeouts {
+  static inline atomic<chrono::milliseconds> handshake{chrono::seconds{10}};
+  static inline atomic<chrono::milliseconds> idle{chrono::seconds{60}};
+  static inline atomic<chrono::milliseconds> read{chrono::seconds{30}};
+  static inline atomic<chrono::milliseconds> write{chrono::seconds{30}};
+};
+
+enum class timeout_kind { handshake, idle, read, write };
+
+// Threads that run service bodies off the io threads. Each worker takes its
+// newest task from its own queue, and when that is empty steals the oldest
+// task from another's. Tasks posted from outside the pool are spread over the
+// queues round robin, while a worker posts to its own queue.
+class worker_pool {
+  struct task_queue {
+    mutex guard;
+    deque<function<void()>> tasks;
+  };
+
+  deque<task_queue> queues;
+  vector<thread> threads;
+  mutex sleep_mutex;
+  condition_variable wakeup;
+  size_t pending = 0;
+  bool stopping = false;
+  atomic_size_t next{0};
+  atomic_size_t blocking{0};
+
+  struct worker {
+    const worker_pool *pool = nullptr;
+    size_t index = 0;
+  };
+
+  static worker &current() {
+    thread_local worker self;
+    return self;
+  }
+
+  bool take(size_t index, function<void()> &task) {
+    for (size_t n = 0; n < queues.size(); ++n) {
+      auto &queue = queues[(index + n) % queues.size()];
+      lock_guard<mutex> lock{queue.guard};
+      if (queue.tasks.empty())
+        continue;
+      if (n) {
+        task = move(queue.tasks.front());
+        queue.tasks.pop_front();
+      } else {
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void work(size_t index) {
+    current() = {this, index};
+    function<void()> task;
+    while (true) {
+      if (take(index, task)) {
+        {
+          lock_guard<mutex> lock{sleep_mutex};
+          --pending;
+        }
+        task();
+        task = nullptr;
+        continue;
+      }
+      unique_lock<mutex> lock{sleep_mutex};
+      wakeup.wait(lock, [this] { return pending || stopping; });
+      if (!pending && stopping)
+        return;
+    }
+  }
+
+public:
+  explicit worker_pool(size_t size) : queues(max<size_t>(size, 1)) {
+    for (size_t index = 0; index < queues.size(); ++index)
+      threads.emplace_back([this, index] { work(index); });
+  }
+
+  ~worker_pool() {
+    {
+      lock_guard<mutex> lock{sleep_mutex};
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto &t : threads)
+      t.join();
+  }
+
+  size_t size() const { return queues.size(); }
+
+  // Claims a worker for a task that waits on its connection, such as a call
+  // reading a streamed argument. Such tasks get one worker fewer than the
+  // pool has, so that one is always left for the tasks that do not wait.
+  bool claim_blocking() {
+    for (auto n = blocking.load(); n + 1 < queues.size();)
+      if (blocking.compare_exchange_weak(n, n + 1))
+        return true;
+    return false;
+  }
+  void release_blocking() { --blocking; }
+
+  void post(function<void()> task) {
+    auto &self = current();
+    auto index = self.pool == this ? self.index : next++ % queues.size();
+    // Counted before it is queued, so a worker that takes it at once never
+    // takes pending below zero; one that wakes first only looks again.
+    {
+      lock_guard<mutex> lock{sleep_mutex};
+      ++pending;
+    }
+    {
+      lock_guard<mutex> lock{queues[index].guard};
+      queues[index].tasks.push_back(move(task));
+    }
+    wakeup.notify_one();
+  }
+};
+
+// One io_service per thread, each thread pinned to a cpu, so that a
+// connection is served on the thread that accepted it for its whole life
+// and the threads share no reactor queue.
+class io_pool {
+  deque<io_service> services;
+  deque<io_service::work> work;
+  vector<thread> threads;
+
+public:
+  explicit io_pool(size_t size) {
+    for (size = max<size_t>(size, 1); size--;) {
+      services.emplace_back(1);
+      work.emplace_back(services.back());
+    }
+  }
+  ~io_pool() {
+    stop();
+    join();
+  }
+
+  size_t size() const { return services.size(); }
+  io_service &operator[](size_t index) { return services[index]; }
+
+  // Starts a thread per io_service, calling body with it. Thread i runs on
+  // cpu i, wrapping around when there are more threads than cpus.
+  template <typename F> void start(F body) {
+    auto cpus = max(1u, thread::hardware_concurrency());
+    for (size_t i = threads.size(); i < services.size(); ++i) {
+      threads.emplace_back([ this, i, body ]() { body(services[i]); });
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(i % cpus, &cpu);
+      pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpu),
+                             &cpu);
+    }
+  }
+  void stop() {
+    for (auto &service : services)
+      service.stop();
+  }
+  void join() {
+    for (auto &t : threads)
+      if (t.joinable())
+        t.join();
+  }
+};
+
+// The deadlines of the connections of one io_service, in a wheel for each
+// thread that arms them: one wheel for an io_service of an io_pool, and a
+// wheel a thread for threads that share an io_service. A wheel hashes its
+// deadlines by tick into a ring of slots that one steady_timer steps through
+// while any are watched. Moving a deadline later costs its owner nothing: a
+// check runs when its slot comes round and returns when it should run again,
+// or time_point::max() to stop watching.
+class timer_wheel : public io_service::service {
+public:
+  using time_point = chrono::steady_clock::time_point;
+  using check = function<time_point(time_point)>;
+
+  static inline io_service::id id;
+
+  explicit timer_wheel(io_service &service) : io_service::service{service} {}
+
+  void watch(time_point at, check c) { local().watch(at, move(c)); }
+
+private:
+  class wheel {
+    static constexpr size_t slot_count = 512;
+    static constexpr chrono::milliseconds resolution{100};
+
+    struct entry {
+      uint64_t tick;
+      check c;
+    };
+
+    mutex guard;
+    array<vector<entry>, slot_count> slots;
+    steady_timer timer;
+    uint64_t current = 0;
+    size_t watched = 0;
+    bool ticking = false;
+
+    static uint64_t ticks(time_point t) {
+      return t.time_since_epoch() / resolution;
+    }
+
+    // Called with guard held. Rounds up, and never into a slot gone by.
+    void insert(time_point at, check c) {
+      auto tick = max(ticks(at) + 1, current + 1);
+      slots[tick % slot_count].push_back({tick, move(c)});
+      ++watched;
+    }
+
+    // Called with guard held.
+    void schedule() {
+      timer.expires_at(time_point{(current + 1) * resolution});
+      timer.async_wait([this](const boost::system::error_code &ec) {
+        if (!ec)
+          advance();
+      });
+    }
+
+    void advance() {
+      vector<entry> due;
+      {
+        lock_guard<mutex> lock{guard};
+        for (auto now = ticks(chrono::steady_clock::now()); current < now;) {
+          auto &slot = slots[++current % slot_count];
+          auto later = partition(begin(slot), end(slot), [this](auto &e) {
+            return e.tick > current;
+          });
+          move(later, end(slot), back_inserter(due));
+          slot.erase(later, end(slot));
+        }
+        watched -= due.size();
+      }
+      auto now = chrono::steady_clock::now();
+      for (auto &e : due)
+        if (auto at = e.c(now); at != time_point::max()) {
+          lock_guard<mutex> lock{guard};
+          insert(at, move(e.c));
+        }
+      lock_guard<mutex> lock{guard};
+      if (watched)
+        schedule();
+      else
+        ticking = false;
+    }
+
+  public:
+    explicit wheel(io_service &service) : timer{service} {}
+
+    void watch(time_point at, check c) {
+      lock_guard<mutex> lock{guard};
+      if (exchange(ticking, true)) {
+        insert(at, move(c));
+        return;
+      }
+      current = ticks(chrono::steady_clock::now());
+      insert(at, move(c));
+      schedule();
+    }
+
+    void clear() {
+      lock_guard<mutex> lock{guard};
+      for (auto &slot : slots)
+        slot.clear();
+      watched = 0;
+    }
+  };
+
+  static inline atomic_size_t services{0};
+  const size_t serial = ++services;
+  mutex wheels_guard;
+  deque<wheel> wheels;
+  unordered_map<thread::id, wheel *> by_thread;
+
+  // The wheel of the calling thread, remembered by the thread for the last
+  // service it asked.
+  wheel &local() {
+    thread_local size_t cached_serial = 0;
+    thread_local wheel *cached = nullptr;
+    if (cached_serial == serial)
+      return *cached;
+    lock_guard<mutex> lock{wheels_guard};
+    auto &w = by_thread[this_thread::get_id()];
+    if (!w)
+      w = &wheels.emplace_back(get_io_service());
+    cached_serial = serial;
+    return *(cached = w);
+  }
+
+  void shutdown_service() override {
+    lock_guard<mutex> lock{wheels_guard};
+    for (auto &w : wheels)
+      w.clear();
+  }
+};
+
+// The socket under the websocket stream of a connection. While corked, what
+// the stream writes, its own control frames among them, is gathered in order
+// instead of sent, and uncorking sends it all in one write. So a batch of
+// frames costs one syscall while the stream still frames each of them.
+class corked_socket {
+  ip::tcp::socket &socket;
+  bool corked = false;
+  vector<uint8_t> held;
+  vector<uint8_t> sending;
+
+  template <typename Buffers> size_t hold(const Buffers &buffers) {
+    auto size = buffer_size(buffers);
+    auto at = held.size();
+    held.resize(at + size);
+    return buffer_copy(buffer(held.data() + at, size), buffers);
+  }
+
+public:
+  using next_layer_type = ip::tcp::socket;
+  using lowest_layer_type = ip::tcp::socket::lowest_layer_type;
+
+  explicit corked_socket(ip::tcp::socket &socket) : socket{socket} {}
+
+  io_service &get_io_service() { return socket.get_io_service(); }
+  next_layer_type &next_layer() { return socket; }
+  lowest_layer_type &lowest_layer() { return socket.lowest_layer(); }
+
+  // Starts gathering writes, with room for bytes of them.
+  void cork(size_t bytes) {
+    corked = true;
+    held.reserve(bytes);
+  }
+
+  // Sends what was gathered. The stream may write again while it is being
+  // sent, so that is gathered too, and sent after it.
+  void uncork(yield_context yield, boost::system::error_code &ec) {
+    while (!held.empty() && !ec) {
+      swap(sending, held);
+      held.clear();
+      boost::asio::async_write(socket, buffer(sending), yield[ec]);
+    }
+    corked = false;
+    held = {};
+    sending = {};
+  }
+
+  template <typename Buffers>
+  size_t read_some(const Buffers &buffers, boost::system::error_code &ec) {
+    return socket.read_some(buffers, ec);
+  }
+  template <typename Buffers> size_t read_some(const Buffers &buffers) {
+    return socket.read_some(buffers);
+  }
+  template <typename Buffers>
+  size_t write_some(const Buffers &buffers, boost::system::error_code &ec) {
+    ec = {};
+    return corked ? hold(buffers) : socket.write_some(buffers, ec);
+  }
+  template <typename Buffers> size_t write_some(const Buffers &buffers) {
+    return corked ? hold(buffers) : socket.write_some(buffers);
+  }
+
+  template <typename Buffers, typename Handler>
+  void async_read_some(const Buffers &buffers, Handler &&handler) {
+    socket.async_read_some(buffers, forward<Handler>(handler));
+  }
+  template <typename Buffers, typename Handler>
+  void async_write_some(const Buffers &buffers, Handler &&handler) {
+    if (!corked) {
+      socket.async_write_some(buffers, forward<Handler>(handler));
+      return;
+    }
+    auto size = hold(buffers);
+    socket.get_io_service().post(beast::bind_handler(
+        forward<Handler>(handler), boost::system::error_code{}, size));
+  }
+
+  friend void teardown(websocket::teardown_tag tag, corked_socket &cork,
+                       boost::system::error_code &ec) {
+    websocket::teardown(tag, cork.socket, ec);
+  }
+  template <typename Handler>
+  friend void async_teardown(websocket::teardown_tag tag, corked_socket &cork,
+                             Handler &&handler) {
+    websocket::async_teardown(tag, cork.socket, forward<Handler>(handler));
+  }
+};
+
 template <typename Handler>
 class connection final : public enable_shared_from_this<connection<Handler>> {
 
@@ -86,6 +838,49 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
   N2W__SUPPORT(websocket_handles_binary,
                typename T::websocket_handler_type, operator(), vector<uint8_t>);
 
+  // Handlers whose replies name the request they answer, e.g. by a request
+  // id, set unordered_replies so each reply leaves as soon as it is ready.
+  static auto unordered_support(...) -> false_type;
+  template <typename T = websocket_handler_type>
+  static auto unordered_support(T *) -> bool_constant<T::unordered_replies>;
+  static constexpr bool websocket_replies_unordered =
+      decltype(unordered_support(declval<websocket_handler_type *>()))::value;
+
+  N2W__SUPPORT(websocket_runs_inline, typename T::websocket_handler_type,
+               runs_inline, const vector<uint8_t> &);
+
+  // Handlers split a large reply into messages the client puts back
+  // together: fragment returns the message starting at offset, of at most
+  // the given bytes of the reply, and advances offset past them.
+  N2W__SUPPORT(websocket_fragments, typename T::websocket_handler_type,
+               fragment, const vector<uint8_t> &, size_t &, size_t);
+  static constexpr bool fragments_replies =
+      websocket_replies_unordered && websocket_fragments;
+
+  // Handlers name the worker_pool to run a call on, or none for the io
+  // threads.
+  N2W__SUPPORT(websocket_runs_on_workers, typename T::websocket_handler_type,
+               worker, const vector<uint8_t> &);
+
+  // Handlers tell the message opening a call with a streamed argument, with
+  // the key its chunks carry and the argument's length, and the messages
+  // carrying chunks, with their key and where the bytes start. The call then
+  // runs on a worker with a byte_source the chunks feed.
+  N2W__SUPPORT(websocket_opens_streams, typename T::websocket_handler_type,
+               opens_stream, const vector<uint8_t> &, uint64_t &, uint64_t &);
+  N2W__SUPPORT(websocket_feeds_streams, typename T::websocket_handler_type,
+               stream_chunk, const vector<uint8_t> &, uint64_t &, size_t &);
+  N2W__SUPPORT(websocket_calls_with_streams,
+               typename T::websocket_handler_type, operator(),
+               vector<uint8_t>, byte_source &);
+  // Handlers answer a call opening a stream when no worker can be spared
+  // for it. Handlers that cannot leave it to fail as a plain call.
+  N2W__SUPPORT(websocket_refuses_streams, typename T::websocket_handler_type,
+               refuse_stream, const vector<uint8_t> &);
+  static constexpr bool streams_arguments =
+      websocket_opens_streams && websocket_feeds_streams &&
+      websocket_calls_with_streams && websocket_runs_on_workers;
+
   N2W__SUPPORT(supports_response_decoration, typename T::websocket_handler_type,
                decorate, http::request<http::string_body> &,
                http::response<http::string_body> &);
@@ -116,6 +911,8 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
                   chrono::system_clock::time_point);
   N2W__SUPPORT_IF(supports_http, reports_task_end, T, report_task_end,
                   chrono::system_clock::time_point);
+  N2W__SUPPORT_IF(supports_http, reports_wakeup, T, report_wakeup,
+                  chrono::system_clock::time_point);
   N2W__SUPPORT_IF(supports_http, reports_accept, T, report_accept,
                   chrono::system_clock::time_point);
   N2W__SUPPORT_IF(supports_http, reports_connect, T, report_connect,
@@ -126,6 +923,13 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
                   chrono::system_clock::time_point, bool);
   N2W__SUPPORT_IF(supports_http, reports_error, T, report_error,
                   boost::system::error_code);
+  N2W__SUPPORT_IF(supports_http, reports_pause, T, report_pause,
+                  chrono::system_clock::time_point);
+  N2W__SUPPORT_IF(supports_http, reports_resume, T, report_resume,
+                  chrono::system_clock::time_point);
+  N2W__SUPPORT_IF(supports_http, reports_write, T, report_write, size_t);
+  N2W__SUPPORT_IF(supports_http, reports_timeout, T, report_timeout,
+                  timeout_kind);
 
   /**********************************/
   /* INTERNAL STRUCTURE DEFINITIONS */
@@ -150,55 +954,547 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
   struct websocket_stuff {
     bool open = false;
     websocket_handler_type websocket_handler;
-    istream stream;
-    websocket_stuff(boost::asio::streambuf *buf) : stream(buf) {}
   };
 
   struct private_construction_tag {};
 
-  struct ticket_sentinel {
-    reference_wrapper<connection> conn;
-    const uintmax_t tkt;
-    ticket_sentinel(connection &conn, uintmax_t tkt) : conn(conn), tkt(tkt) {}
-    ~ticket_sentinel() { ++conn.get().serving; }
-
-    bool operator!() const { return tkt != conn.get().serving; }
+  // Replies leave in the order their requests arrived. A slot is reserved
+  // when a request is read and filled when its reply is ready, unless the
+  // reply is unordered and takes its slot only once it is ready. One writer
+  // coroutine drains filled slots from the front, parks on a timer while the
+  // front slot is pending and retires when the queue is empty. The writer,
+  // the reader and the cancels that wake them share the strand of the
+  // connection, as the websocket stream allows one strand to drive it, and a
+  // wakeup cannot be lost. Client requests queue as operations run on the
+  // writer. Tasks in flight and bytes queued count against the flow_limits;
+  // a reader over them parks on its timer, woken like the writer.
+  using operation = function<void(yield_context)>;
+  using outbound_frame = variant<nullptr_t, http::response<http::string_body>,
+                                 string, vector<uint8_t>, operation>;
+  struct outbound {
+    bool ready = false;
+    outbound_frame frame;
   };
+  using outbound_slot = typename list<outbound>::iterator;
 
   /*******************/
   /* INTERNAL LAYOUT */
   /*******************/
 
   ip::tcp::socket socket;
-  websocket::stream<ip::tcp::socket &> ws;
-  atomic_uintmax_t ticket{0};
-  atomic_uintmax_t serving{0};
+  corked_socket cork;
+  websocket::stream<corked_socket &> ws;
+  io_service::strand strand;
+  steady_timer writer_timer;
+  steady_timer reader_timer;
+  mutex outbound_mutex;
+  list<outbound> outbound_queue;
+  bool writing = false;
+  bool parked = false;
+  bool reader_parked = false;
+  bool serving_websocket = false;
+  size_t in_flight = 0;
+  size_t stream_calls = 0;
+  size_t outbound_bytes = 0;
+  size_t streamed_bytes = 0;
+
+  // Sources of the streamed arguments still being fed, by key. Only the
+  // reader touches them.
+  unordered_map<uint64_t, shared_ptr<byte_source>> streams;
+
+  // Large replies being written a fragment at a time, and how far each got.
+  // Only the writer touches them.
+  struct bulk_reply {
+    vector<uint8_t> reply;
+    size_t offset = 0;
+  };
+  list<bulk_reply> bulk;
+
+  // When the reader and the writer run out of time, and at what. The wheel
+  // checks them next at watched_at, and a check of an older generation than
+  // watch_generation was replaced by an earlier one. All under outbound_mutex.
+  struct deadline {
+    timer_wheel::time_point at = timer_wheel::time_point::max();
+    timeout_kind kind = timeout_kind::idle;
+  };
+  deadline read_deadline;
+  deadline write_deadline;
+  timer_wheel::time_point watched_at = timer_wheel::time_point::max();
+  size_t watch_generation = 0;
 
-  boost::asio::streambuf buf;
+  message_buffer buf;
   conditional_t<supports_http, Handler, NullHandler> handler;
-  conditional_t<supports_websocket, websocket_stuff, void *> ws_stuff{&buf};
+  conditional_t<supports_websocket, websocket_stuff, void *> ws_stuff{};
 
   /***********************/
   /* INTERNAL OPERATIONS */
   /***********************/
 
-  template <typename R>
-  void write_response(yield_context yield, R reply,
-                      const ticket_sentinel &sentinel) {
+  void start_writer() {
+    spawn(strand,
+          [ this, self = this->shared_from_this() ](yield_context yield) {
+            if constexpr (reports_wakeup)
+              handler.report_wakeup(chrono::system_clock::now());
+            drain(yield);
+          },
+          pooled_stack{16 << 10});
+  }
+
+  outbound_slot reserve() {
+    unique_lock<mutex> lock{outbound_mutex};
+    auto slot = outbound_queue.emplace(end(outbound_queue));
+    if (exchange(writing, true))
+      return slot;
+    lock.unlock();
+    start_writer();
+    return slot;
+  }
+
+  template <typename F> static size_t frame_bytes(const F &frame) {
+    if constexpr (is_same_v<F, string> || is_same_v<F, vector<uint8_t>>)
+      return frame.size();
+    else if constexpr (is_same_v<F, http::response<http::string_body>>)
+      return frame.body.size();
+    else
+      return 0;
+  }
+
+  bool over_limits() const {
+    auto calls = flow_limits::max_in_flight.load();
+    auto bytes = flow_limits::max_outbound_bytes.load();
+    auto streamed = flow_limits::max_streamed_bytes.load();
+    return (calls && in_flight - stream_calls >= calls) ||
+           (bytes && outbound_bytes >= bytes) ||
+           (streamed && streamed_bytes >= streamed);
+  }
+
+  // Called with outbound_mutex held.
+  void wake_reader() {
+    if (!reader_parked || over_limits())
+      return;
+    reader_parked = false;
+    strand.post([ this, self = this->shared_from_this() ] {
+      reader_timer.cancel();
+    });
+  }
+
+  // Parks the reading coroutine while the connection is over its limits.
+  void wait_for_room(yield_context yield) {
+    boost::system::error_code ec;
+    unique_lock<mutex> lock{outbound_mutex};
+    if (!over_limits())
+      return;
+    if constexpr (reports_pause)
+      handler.report_pause(chrono::system_clock::now());
+    while (over_limits()) {
+      reader_parked = true;
+      lock.unlock();
+      reader_timer.expires_at(steady_timer::time_point::max());
+      reader_timer.async_wait(yield[ec]);
+      lock.lock();
+    }
+    if constexpr (reports_resume)
+      handler.report_resume(chrono::system_clock::now());
+  }
+
+  void start_task() {
+    lock_guard<mutex> lock{outbound_mutex};
+    ++in_flight;
+  }
+
+  void end_task() {
+    lock_guard<mutex> lock{outbound_mutex};
+    --in_flight;
+    wake_reader();
+  }
+
+  // Starts the call a message opens on a worker, with a source for its
+  // streamed argument that the chunks after it feed.
+  bool open_stream(vector<uint8_t> &message) {
+    if constexpr (streams_arguments) {
+      uint64_t key = 0, length = 0;
+      if (!ws_stuff.websocket_handler.opens_stream(message, key, length))
+        return false;
+      // Without a worker to block, the call is left to fail as a plain one.
+      auto workers = ws_stuff.websocket_handler.worker(message);
+      if (!workers)
+        return false;
+      // Nor may stream calls take every worker. A call refused is answered
+      // at once, and the chunks that follow it find no stream.
+      if (!workers->claim_blocking()) {
+        if constexpr (websocket_refuses_streams) {
+          async(ws_stuff.websocket_handler.refuse_stream(message));
+          return true;
+        } else {
+          return false;
+        }
+      }
+      auto source = make_shared<byte_source>(
+          length, [self = this->weak_from_this()](size_t bytes) {
+            if (auto conn = self.lock())
+              conn->stream_read(bytes);
+          });
+      if (auto replaced = exchange(streams[key], source))
+        stream_read(replaced->abort());
+      if (source->filled())
+        streams.erase(key);
+      {
+        lock_guard<mutex> lock{outbound_mutex};
+        ++stream_calls;
+      }
+      offload<!websocket_replies_unordered>(*workers, [
+        this, message = move(message), source, workers
+      ]() mutable {
+        auto reply = ws_stuff.websocket_handler(move(message), *source);
+        stream_read(source->abort());
+        workers->release_blocking();
+        lock_guard<mutex> lock{outbound_mutex};
+        --stream_calls;
+        return reply;
+      });
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // Feeds a chunk to the source of its stream. Chunks of streams not open
+  // are dropped.
+  bool feed_stream(vector<uint8_t> &message) {
+    if constexpr (streams_arguments) {
+      uint64_t key = 0;
+      size_t offset = 0;
+      if (!ws_stuff.websocket_handler.stream_chunk(message, key, offset))
+        return false;
+      auto stream = streams.find(key);
+      if (stream == end(streams))
+        return true;
+      auto source = stream->second;
+      auto bytes = source->feed(move(message), offset);
+      {
+        lock_guard<mutex> lock{outbound_mutex};
+        streamed_bytes += bytes;
+        connection_memory::streamed_arguments += bytes;
+      }
+      if (source->filled())
+        streams.erase(stream);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // Called as services read or drop streamed bytes.
+  void stream_read(size_t bytes) {
+    if (!bytes)
+      return;
+    lock_guard<mutex> lock{outbound_mutex};
+    streamed_bytes -= bytes;
+    connection_memory::streamed_arguments -= bytes;
+    wake_reader();
+  }
+
+  // Sets a deadline a timeout from now, or clears it for a zero timeout, and
+  // has the wheel of the io_service check it in time.
+  void arm(deadline &d, timeout_kind kind, chrono::milliseconds timeout) {
+    lock_guard<mutex> lock{outbound_mutex};
+    d.kind = kind;
+    d.at = timeout.count() ? chrono::steady_clock::now() + timeout
+                           : timer_wheel::time_point::max();
+    if (d.at >= watched_at)
+      return;
+    watched_at = d.at;
+    use_service<timer_wheel>(socket.get_io_service())
+        .watch(d.at, [ self = this->weak_from_this(),
+                       generation = ++watch_generation ](auto now) {
+          auto conn = self.lock();
+          return conn ? conn->check_deadlines(now, generation)
+                      : timer_wheel::time_point::max();
+        });
+  }
+
+  void disarm(deadline &d) { arm(d, d.kind, chrono::milliseconds{0}); }
+
+  // Runs on the wheel, and returns when to run again. An idle connection is
+  // not idle while calls are running or replies are being written. Expiry
+  // itself is left to the strand.
+  timer_wheel::time_point check_deadlines(timer_wheel::time_point now,
+                                          size_t generation) {
+    unique_lock<mutex> lock{outbound_mutex};
+    if (generation != watch_generation)
+      return timer_wheel::time_point::max();
+    auto &due = read_deadline.at < write_deadline.at ? read_deadline
+                                                     : write_deadline;
+    if (due.at <= now && due.kind == timeout_kind::idle &&
+        (in_flight || writing)) {
+      auto idle = connection_timeouts::idle.load();
+      due.at = idle.count() ? now + idle : timer_wheel::time_point::max();
+    }
+    if (due.at > now)
+      return watched_at = min(read_deadline.at, write_deadline.at);
+    auto kind = due.kind;
+    auto open_websocket = serving_websocket;
+    read_deadline.at = write_deadline.at = watched_at =
+        timer_wheel::time_point::max();
+    lock.unlock();
+    strand.dispatch([ this, self = this->shared_from_this(), kind,
+                      open_websocket ] { expire(kind, open_websocket); });
+    return timer_wheel::time_point::max();
+  }
+
+  // Closes an idle websocket with a close frame, leaving the client the read
+  // timeout to answer it, and shuts any other connection out of time down.
+  // Runs on the strand, as the socket and the stream are used on it.
+  void expire(timeout_kind kind, bool open_websocket) {
+    if constexpr (reports_timeout)
+      handler.report_timeout(kind);
+    if constexpr (supports_websocket) {
+      auto closing = connection_timeouts::read.load();
+      if (kind == timeout_kind::idle && open_websocket && closing.count()) {
+        arm(read_deadline, timeout_kind::read, closing);
+        enqueue([this](yield_context yield) {
+          boost::system::error_code ec;
+          ws.async_close(websocket::close_code::going_away, yield[ec]);
+        });
+        return;
+      }
+    }
     boost::system::error_code ec;
-    while (!sentinel) {
-      clog << "Waiting to serve: " << sentinel.tkt
-           << ", currently serving: " << serving << ", is open: " << boolalpha
-           << socket.is_open() << '\n';
-      socket.get_io_service().post(yield[ec]);
+    socket.shutdown(ip::tcp::socket::shutdown_both, ec);
+  }
+
+  // Called with outbound_mutex held.
+  void written(size_t bytes) {
+    outbound_bytes -= bytes;
+    connection_memory::queued_replies -= bytes;
+    wake_reader();
+  }
+
+  template <typename F> void fill(outbound_slot slot, F frame) {
+    {
+      lock_guard<mutex> lock{outbound_mutex};
+      outbound_bytes += frame_bytes(frame);
+      connection_memory::queued_replies += frame_bytes(frame);
+      slot->frame = move(frame);
+      slot->ready = true;
+      if (slot != begin(outbound_queue) || !exchange(parked, false))
+        return;
+    }
+    strand.post([ this, self = this->shared_from_this() ] {
+      writer_timer.cancel();
+    });
+  }
+
+  void enqueue(operation op) { fill(reserve(), move(op)); }
+
+  // Writes a reply from the calling coroutine when no writer is busy, and
+  // otherwise queues it like any other. Replies queued meanwhile get a writer
+  // of their own once this one is out.
+  template <typename R> void write_now(yield_context yield, R reply) {
+    {
+      unique_lock<mutex> lock{outbound_mutex};
+      if (exchange(writing, true)) {
+        lock.unlock();
+        fill(reserve(), move(reply));
+        return;
+      }
+    }
+    write_response(yield, move(reply));
+    {
+      lock_guard<mutex> lock{outbound_mutex};
+      if (outbound_queue.empty()) {
+        writing = false;
+        return;
+      }
+    }
+    start_writer();
+  }
+
+  void drain(yield_context yield) {
+    boost::system::error_code ec;
+    unique_lock<mutex> lock{outbound_mutex};
+    bool fragment_turn = false;
+    while (!outbound_queue.empty() || !bulk.empty()) {
+      if constexpr (fragments_replies) {
+        if (serving_websocket)
+          promote_urgent();
+        auto whole = !outbound_queue.empty() && outbound_queue.front().ready;
+        if (whole && serving_websocket && is_bulk(outbound_queue.front())) {
+          bulk.push_back(
+              {move(get<vector<uint8_t>>(outbound_queue.front().frame))});
+          outbound_queue.pop_front();
+          continue;
+        }
+        if (!bulk.empty() && (fragment_turn || !whole)) {
+          fragment_turn = false;
+          lock.unlock();
+          auto bytes = write_fragment(yield);
+          lock.lock();
+          written(bytes);
+          continue;
+        }
+        fragment_turn = !bulk.empty();
+      }
+      if (!outbound_queue.front().ready) {
+        parked = true;
+        lock.unlock();
+        writer_timer.expires_at(steady_timer::time_point::max());
+        writer_timer.async_wait(yield[ec]);
+        if constexpr (reports_wakeup)
+          handler.report_wakeup(chrono::system_clock::now());
+        lock.lock();
+        continue;
+      }
+      if constexpr (supports_websocket) {
+        vector<outbound_frame> batch;
+        if (serving_websocket && take_batch(batch)) {
+          if (batch.size() < batch_limit() &&
+              write_batching::max_delay.load().count()) {
+            lock.unlock();
+            writer_timer.expires_from_now(write_batching::max_delay.load());
+            writer_timer.async_wait(yield[ec]);
+            lock.lock();
+            take_batch(batch);
+          }
+          lock.unlock();
+          auto bytes = write_batch(yield, batch);
+          lock.lock();
+          written(bytes);
+          continue;
+        }
+      }
+      auto frame = move(outbound_queue.front().frame);
+      outbound_queue.pop_front();
+      lock.unlock();
+      auto bytes = visit([](const auto &reply) { return frame_bytes(reply); },
+                         frame);
+      visit([this, &yield](auto &reply) { write_response(yield, move(reply)); },
+            frame);
+      lock.lock();
+      written(bytes);
+    }
+    writing = false;
+  }
+
+  static bool is_bulk(const outbound &slot) {
+    auto limit = reply_fragmenting::fragment_bytes.load();
+    return fragments_replies && limit &&
+           holds_alternative<vector<uint8_t>>(slot.frame) &&
+           get<vector<uint8_t>>(slot.frame).size() > limit;
+  }
+
+  // Moves the first urgent reply ready to the front of the queue. Called with
+  // outbound_mutex held.
+  void promote_urgent() {
+    auto limit = reply_fragmenting::urgent_bytes.load();
+    if (!limit)
+      return;
+    auto urgent = find_if(
+        begin(outbound_queue), end(outbound_queue), [limit](const auto &slot) {
+          return slot.ready &&
+                 (holds_alternative<string>(slot.frame) ||
+                  holds_alternative<vector<uint8_t>>(slot.frame)) &&
+                 visit([](const auto &f) { return frame_bytes(f); },
+                       slot.frame) <= limit;
+        });
+    if (urgent != end(outbound_queue) && urgent != begin(outbound_queue))
+      outbound_queue.splice(begin(outbound_queue), outbound_queue, urgent);
+  }
+
+  // Writes the next fragment of the first large reply, then sends the reply
+  // to the back so that large replies take turns. Returns the bytes of the
+  // reply once it is all written.
+  size_t write_fragment(yield_context yield) {
+    if constexpr (fragments_replies) {
+      auto &next = bulk.front();
+      auto message = ws_stuff.websocket_handler.fragment(
+          next.reply, next.offset,
+          max<size_t>(reply_fragmenting::fragment_bytes, 1));
+      write_response(yield, move(message));
+      size_t bytes = 0;
+      if (next.offset < next.reply.size())
+        bulk.push_back(move(next));
+      else
+        bytes = next.reply.size();
+      bulk.pop_front();
+      return bytes;
+    } else {
+      return 0;
+    }
+  }
+
+  static size_t batch_limit() {
+    return max<size_t>(write_batching::max_frames, 1);
+  }
+
+  // Moves the websocket frames ready at the front of the queue into batch, up
+  // to the batch limit. Called with outbound_mutex held.
+  bool take_batch(vector<outbound_frame> &batch) {
+    auto taken = batch.size();
+    while (batch.size() < batch_limit() && !outbound_queue.empty() &&
+           outbound_queue.front().ready && !is_bulk(outbound_queue.front()) &&
+           (holds_alternative<string>(outbound_queue.front().frame) ||
+            holds_alternative<vector<uint8_t>>(outbound_queue.front().frame))) {
+      batch.push_back(move(outbound_queue.front().frame));
+      outbound_queue.pop_front();
     }
+    return batch.size() > taken;
+  }
+
+  // Writes websocket frames and returns their bytes. The stream frames each
+  // of a batch, and the socket under it is corked meanwhile, so they leave in
+  // one write. A server frame has a header of at most 10 bytes.
+  size_t write_batch(yield_context yield, vector<outbound_frame> &batch) {
+    size_t bytes = 0;
+    for (auto &frame : batch)
+      bytes += visit([](const auto &f) { return frame_bytes(f); }, frame);
+    if (batch.size() == 1) {
+      visit([this, &yield](auto &reply) { write_response(yield, move(reply)); },
+            batch.front());
+      return bytes;
+    }
+    if constexpr (reports_write)
+      handler.report_write(batch.size());
+
+    boost::system::error_code ec, flushed;
+    arm(write_deadline, timeout_kind::write, connection_timeouts::write);
+    cork.cork(bytes + 10 * batch.size());
+    for (auto &frame : batch) {
+      visit(
+          [this, &yield, &ec](const auto &f) {
+            using F = decay_t<decltype(f)>;
+            if constexpr (is_same_v<F, string> ||
+                          is_same_v<F, vector<uint8_t>>) {
+              ws.binary(is_same_v<F, vector<uint8_t>>);
+              ws.async_write(buffer(f), yield[ec]);
+            }
+          },
+          frame);
+      if (ec)
+        break;
+    }
+    cork.uncork(yield, flushed);
+    disarm(write_deadline);
+    if (ec || flushed)
+      ws_stuff.websocket_handler = websocket_handler_type{};
+    return bytes;
+  }
 
+  template <typename R> void write_response(yield_context yield, R reply) {
+    boost::system::error_code ec;
     string response_type;
+    if constexpr (is_same_v<R, operation>) {
+      reply(yield);
+      return;
+    }
+    arm(write_deadline, timeout_kind::write, connection_timeouts::write);
     if constexpr (is_same_v<R, http::response<http::string_body>>) {
       reply.prepare_payload();
       http::async_write(socket, reply, yield[ec]);
       response_type = "HTTP";
-    } else if constexpr (!is_same_v<R, nullptr_t> && supports_websocket) {
+    } else if constexpr (supports_websocket &&
+                         (is_same_v<R, string> ||
+                          is_same_v<R, vector<uint8_t>>)) {
       if constexpr (is_same_v<R, string>) {
         ws.text(true);
         response_type = "text websocket";
@@ -206,58 +1502,127 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
         ws.binary(true);
         response_type = "binary websocket";
       }
+      if constexpr (reports_write)
+        handler.report_write(1);
       ws.async_write(buffer(reply), yield[ec]);
       if (ec)
         ws_stuff.websocket_handler = websocket_handler_type{};
     }
+    disarm(write_deadline);
 
     clog << "Thread: " << this_thread::get_id() << "; Written " << response_type
          << " response: " << ec.message() << ".\n";
   }
 
-  template <typename T> auto async(T t) {
+  static void log_failure(exception_ptr failure) {
+    try {
+      rethrow_exception(failure);
+    } catch (const exception &e) {
+      clog << "Task failed: " << e.what() << '\n';
+    } catch (...) {
+      clog << "Task failed\n";
+    }
+  }
+
+  // Tasks without a reply have nothing to order.
+  template <bool in_order, typename T>
+  static constexpr bool takes_slot =
+      in_order && !is_void_v<result_of_t<T()>>;
+
+  // Runs a task and queues its reply, in the slot reserved for it or, for
+  // unordered replies, in one reserved now. A task that throws fills its slot
+  // with nothing, so that the replies behind it still leave, and ends like
+  // the others.
+  template <bool in_order, typename T> void complete(T &t, outbound_slot slot) {
+    if constexpr (reports_task_start)
+      handler.report_task_start(chrono::system_clock::now());
+    try {
+      if constexpr (is_void_v<result_of_t<T()>>)
+        t();
+      else if constexpr (in_order)
+        fill(slot, t());
+      else {
+        auto reply = t();
+        fill(reserve(), move(reply));
+      }
+    } catch (...) {
+      log_failure(current_exception());
+      if constexpr (takes_slot<in_order, T>)
+        fill(slot, nullptr);
+    }
+    end_task();
+    if constexpr (reports_task_end)
+      handler.report_task_end(chrono::system_clock::now());
+  }
+
+  template <bool in_order = true, typename T> auto async(T t) {
     if constexpr (is_same_v<T, http::response<http::string_body>> ||
                   is_same_v<T, string> || is_same_v<T, vector<uint8_t>>) {
-      spawn(socket.get_io_service(),
-            [
-              this, self = this->shared_from_this(), t = forward<T>(t),
-              tkt = ticket++
-            ](yield_context yield) {
-              if constexpr (reports_task_start)
-                handler.report_task_start(chrono::system_clock::now());
-              ticket_sentinel sentinel{*this, tkt};
-              write_response(yield, move(t), sentinel);
-              if constexpr (reports_task_end)
-                handler.report_task_end(chrono::system_clock::now());
-            },
-            boost::coroutines::attributes{12 << 10});
+      if constexpr (reports_task_start)
+        handler.report_task_start(chrono::system_clock::now());
+      fill(reserve(), move(t));
+      if constexpr (reports_task_end)
+        handler.report_task_end(chrono::system_clock::now());
     } else {
+      start_task();
       spawn(socket.get_io_service(),
             [
               this, self = this->shared_from_this(), t = forward<T>(t),
-              tkt = ticket++
-            ](yield_context yield) {
-              if constexpr (reports_task_start)
-                handler.report_task_start(chrono::system_clock::now());
-              ticket_sentinel sentinel{*this, tkt};
-              if constexpr (is_void_v<result_of_t<T()>>) {
-                t();
-                write_response(yield, nullptr, sentinel);
-              } else
-                write_response(yield, t(), sentinel);
-              if constexpr (reports_task_end)
-                handler.report_task_end(chrono::system_clock::now());
-            },
-            boost::coroutines::attributes{16 << 10});
+              slot = takes_slot<in_order, T> ? reserve() : outbound_slot{}
+            ](yield_context yield) mutable { complete<in_order>(t, slot); },
+            pooled_stack{16 << 10});
+    }
+  }
+
+  // Runs a task on a worker pool, off the io threads.
+  template <bool in_order = true, typename T>
+  void offload(worker_pool &workers, T t) {
+    start_task();
+    workers.post([
+      this, self = this->shared_from_this(), t = move(t),
+      slot = takes_slot<in_order, T> ? reserve() : outbound_slot{}
+    ]() mutable { complete<in_order>(t, slot); });
+  }
+
+  // Runs a task on the calling coroutine instead of spawning one, for tasks
+  // cheap enough not to hold up the reads behind them.
+  template <typename T> void run_inline(yield_context yield, T t) {
+    if constexpr (reports_task_start)
+      handler.report_task_start(chrono::system_clock::now());
+    try {
+      if constexpr (is_void_v<result_of_t<T()>>)
+        t();
+      else
+        write_now(yield, t());
+    } catch (const boost::coroutines::detail::forced_unwind &) {
+      throw;
+    } catch (...) {
+      log_failure(current_exception());
     }
+    if constexpr (reports_task_end)
+      handler.report_task_end(chrono::system_clock::now());
   }
 
+  // The first request and its upgrade run against the handshake timeout.
+  // Later requests may take the idle timeout to start and, as nothing reads
+  // ahead of buf, the read timeout from their first byte on.
   void serve(yield_context yield) {
     socket.set_option(ip::tcp::no_delay{true});
+    arm(read_deadline, timeout_kind::handshake, connection_timeouts::handshake);
 
     boost::system::error_code ec;
-    while (true) {
+    for (auto first = true; true; first = false) {
       http::request<http::string_body> request;
+      if (!first) {
+        if (!buf.size()) {
+          buf.trim();
+          arm(read_deadline, timeout_kind::idle, connection_timeouts::idle);
+          socket.async_read_some(null_buffers(), yield[ec]);
+          if (ec)
+            break;
+        }
+        arm(read_deadline, timeout_kind::read, connection_timeouts::read);
+      }
       http::async_read(socket, buf, request, yield[ec]);
       clog << "Thread: " << this_thread::get_id()
            << "; Received request: " << ec.message() << ".\n";
@@ -267,6 +1632,9 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
 
       if (websocket::is_upgrade(request)) {
         if constexpr (supports_websocket) {
+          if (!first)
+            arm(read_deadline, timeout_kind::handshake,
+                connection_timeouts::handshake);
           if constexpr (supports_response_decoration) {
             ws.async_accept_ex(request,
                                [this, request](auto &response) {
@@ -280,7 +1648,10 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
           clog << "Accepted websocket connection: " << ec.message() << '\n';
           if (ec)
             break;
-          ws_stuff.stream >> noskipws;
+          {
+            lock_guard<mutex> lock{outbound_mutex};
+            serving_websocket = true;
+          }
           register_websocket_pusher();
           goto do_upgrade;
         } else
@@ -295,11 +1666,13 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
         break;
       }
     }
+    disarm(read_deadline);
     clog << "Finished serving socket\n";
 
     return;
   do_upgrade:
     ws_serve(ec, yield);
+    disarm(read_deadline);
     clog << "Finished serving websocket\n";
   }
 
@@ -312,38 +1685,66 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
         handler.report_upgrade(chrono::system_clock::now());
       }
 
-      auto save_stream = [this](auto &message) {
-        copy(istream_iterator<char>(ws_stuff.stream), {},
-             back_inserter(message));
-        ws_stuff.stream.clear();
-      };
-
       while (true) {
+        wait_for_room(yield);
+        buf.trim();
+        arm(read_deadline, timeout_kind::idle, connection_timeouts::idle);
         ws.async_read(buf, yield[ec]);
         clog << "Read something from websocket: " << ec.message() << '\n';
         if (ec)
           break;
         if (ws.got_text()) {
-          string message;
-          save_stream(message);
+          auto data = buf.data();
+          string message{buffer_cast<const char *>(data), buffer_size(data)};
+          buf.consume(buf.size());
           clog << "Text message received: " << message << '\n';
           if constexpr (websocket_handles_text)
-            async([ this, message = move(message) ] {
-              return ws_stuff.websocket_handler(message);
+            async<!websocket_replies_unordered>([
+              this, message = move(message)
+            ]() mutable {
+              return ws_stuff.websocket_handler(move(message));
             });
         } else if (ws.got_binary()) {
-          vector<uint8_t> message;
-          save_stream(message);
+          auto message = buf.release();
           clog << "Binary message received, size: " << message.size() << '\n';
+          if (feed_stream(message) || open_stream(message))
+            continue;
+          if constexpr (websocket_runs_inline) {
+            if (ws_stuff.websocket_handler.runs_inline(message)) {
+              run_inline(yield, [ this, &message ]() {
+                return ws_stuff.websocket_handler(move(message));
+              });
+              continue;
+            }
+          }
+          if constexpr (websocket_runs_on_workers) {
+            if (auto workers = ws_stuff.websocket_handler.worker(message)) {
+              offload<!websocket_replies_unordered>(*workers, [
+                this, message = move(message)
+              ]() mutable {
+                return ws_stuff.websocket_handler(move(message));
+              });
+              continue;
+            }
+          }
           if constexpr (websocket_handles_binary)
-            async([ this, message = move(message) ] {
-              return ws_stuff.websocket_handler(message);
+            async<!websocket_replies_unordered>([
+              this, message = move(message)
+            ]() mutable {
+              return ws_stuff.websocket_handler(move(message));
             });
         } else {
           clog << "Unsupported WebSocket opcode: " << '\n';
           break;
         }
       }
+      for (auto &stream : streams)
+        stream_read(stream.second->abort());
+      streams.clear();
+      {
+        lock_guard<mutex> lock{outbound_mutex};
+        serving_websocket = false;
+      }
       if constexpr (reports_task_end)
         handler.report_task_end(chrono::system_clock::now());
     }
@@ -369,8 +1770,9 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
   /* EXTERNAL INTERFACES */
   /***********************/
 
-  template <typename, typename... Args>
-  friend void accept(reference_wrapper<io_service> service, Args &&... args);
+  template <typename>
+  friend void accept_loop(reference_wrapper<io_service> service,
+                          ip::tcp::acceptor &acceptor, yield_context yield);
 
   template <typename> friend class client_connection;
   template <typename> friend class wsclient_connection;
@@ -390,35 +1792,28 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
                        void(boost::system::error_code,
                             http::response<http::string_body>)>
           completion{ch};
-      spawn(socket.get_io_service(),
-            [
-              this, p, handler = move(completion.completion_handler),
-              tkt = ticket++
-            ](yield_context yield) mutable {
-              if constexpr (reports_task_start)
-                this->handler.report_task_start(chrono::system_clock::now());
-              ticket_sentinel sentinel{*this, tkt};
-              while (!sentinel)
-                socket.get_io_service().post(yield);
-
-              boost::system::error_code ec;
-              auto req = this->handler(p);
-              req.method(http::verb::get);
-              req.prepare_payload();
-              http::async_write(socket, req, yield[ec]);
-              clog << "Thread: " << this_thread::get_id()
-                   << "; Sent request: " << ec.message() << ".\n";
-              http::response<http::string_body> res;
-              http::async_read(socket, buf, res, yield[ec]);
-              clog << "Thread: " << this_thread::get_id()
-                   << "; Received response: " << ec.message() << ".\n";
-              clog << "Resuming coroutine\n";
-              asio_handler_invoke(
-                  [handler, ec, res]() mutable { handler(ec, res); }, &handler);
-              if constexpr (reports_task_end)
-                this->handler.report_task_end(chrono::system_clock::now());
-            },
-            boost::coroutines::attributes{16 << 10});
+      enqueue([ this, p, handler = move(completion.completion_handler) ](
+          yield_context yield) mutable {
+        if constexpr (reports_task_start)
+          this->handler.report_task_start(chrono::system_clock::now());
+
+        boost::system::error_code ec;
+        auto req = this->handler(p);
+        req.method(http::verb::get);
+        req.prepare_payload();
+        http::async_write(socket, req, yield[ec]);
+        clog << "Thread: " << this_thread::get_id()
+             << "; Sent request: " << ec.message() << ".\n";
+        http::response<http::string_body> res;
+        http::async_read(socket, buf, res, yield[ec]);
+        clog << "Thread: " << this_thread::get_id()
+             << "; Received response: " << ec.message() << ".\n";
+        clog << "Resuming coroutine\n";
+        asio_handler_invoke(
+            [handler, ec, res]() mutable { handler(ec, res); }, &handler);
+        if constexpr (reports_task_end)
+          this->handler.report_task_end(chrono::system_clock::now());
+      });
       clog << "Suspending coroutine\n";
       if constexpr (is_void_v<decltype(completion.result.get())>) {
         completion.result.get();
@@ -432,54 +1827,83 @@ class connection final : public enable_shared_from_this<connection<Handler>> {
   }
 
   void upgrade() {
-    spawn(socket.get_io_service(),
-          [ this, self = this->shared_from_this(),
-            tkt = ticket++ ](yield_context yield) {
-            ticket_sentinel sentinel{*this, tkt};
-            while (!sentinel)
-              socket.get_io_service().post(yield);
-
-            boost::system::error_code ec;
-            http::response<http::string_body> res;
-            auto remote = socket.remote_endpoint().address().to_string();
-            clog << "Upgrading websocket host: " << remote << '\n';
-            if constexpr (supports_request_decoration) {
-              ws.async_handshake_ex(res, remote, "/",
-                                    [this](auto &request) {
-                                      ws_stuff.websocket_handler.decorate(
-                                          request);
-                                    },
-                                    yield[ec]);
-            } else {
-              ws.async_handshake(res, remote, "/", yield[ec]);
-            }
-            clog << "Thread: " << this_thread::get_id()
-                 << "; Connected to websocket: " << ec.message() << '\n';
-            if constexpr (reports_upgrade) {
-              ws_stuff.open = true;
-              handler.report_upgrade(chrono::system_clock::now());
-            }
-            if constexpr (supports_upgrade_inspection)
-              ws_stuff.websocket_handler.inspect(res);
-          },
-          boost::coroutines::attributes{8 << 10});
+    enqueue([this](yield_context yield) {
+      boost::system::error_code ec;
+      http::response<http::string_body> res;
+      auto remote = socket.remote_endpoint().address().to_string();
+      clog << "Upgrading websocket host: " << remote << '\n';
+      if constexpr (supports_request_decoration) {
+        ws.async_handshake_ex(res, remote, "/",
+                              [this](auto &request) {
+                                ws_stuff.websocket_handler.decorate(request);
+                              },
+                              yield[ec]);
+      } else {
+        ws.async_handshake(res, remote, "/", yield[ec]);
+      }
+      clog << "Thread: " << this_thread::get_id()
+           << "; Connected to websocket: " << ec.message() << '\n';
+      if constexpr (reports_upgrade) {
+        ws_stuff.open = true;
+        handler.report_upgrade(chrono::system_clock::now());
+      }
+      if constexpr (supports_upgrade_inspection)
+        ws_stuff.websocket_handler.inspect(res);
+    });
   }
 
 public:
   connection(io_service &service, private_construction_tag)
-      : socket{service}, ws{socket}, ws_stuff(&buf) {}
+      : socket{service}, cork{socket}, ws{cork}, strand{service},
+        writer_timer{service}, reader_timer{service} {
+    ++connection_memory::connections;
+  }
   connection() = delete;
   ~connection() {
+    --connection_memory::connections;
+    connection_memory::queued_replies -= outbound_bytes;
     if constexpr (reports_close)
       handler.report_close(chrono::system_clock::now(), ws_stuff.open);
     clog << "Connection deleted.\n";
   }
 };
 
-template <typename Handler, typename... Args>
-void accept(reference_wrapper<io_service> service, Args &&... args) {
-  spawn(service.get(), [ service, endpoint = ip::tcp::endpoint(
-                                      args...) ](yield_context yield) {
+using reuse_port =
+    boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+// A socket listening already, such as one a parent process bound and handed
+// down.
+struct inherited_listener {
+  ip::tcp protocol;
+  int descriptor;
+};
+
+template <typename Handler>
+void accept_loop(reference_wrapper<io_service> service,
+                 ip::tcp::acceptor &acceptor, yield_context yield) {
+  boost::system::error_code ec;
+  while (true) {
+    auto conn = allocate_shared<connection<Handler>>(
+        connection_pool::allocator<connection<Handler>>{}, service,
+        typename connection<Handler>::private_construction_tag{});
+    acceptor.async_accept(conn->socket, yield[ec]);
+    clog << "Thread: " << this_thread::get_id()
+         << "; Accepted connection: " << ec.message() << '\n';
+    if (ec)
+      break;
+    if constexpr (connection<Handler>::reports_accept)
+      conn->handler.report_accept(chrono::system_clock::now());
+    auto strand = conn->strand;
+    spawn(strand,
+          [conn = move(conn)](yield_context yield) { conn->serve(yield); },
+          pooled_stack{16 << 10});
+  }
+}
+
+template <typename Handler>
+void listen_on(reference_wrapper<io_service> service,
+               ip::tcp::endpoint endpoint, bool reuse_port) {
+  spawn(service.get(), [ service, endpoint, reuse_port ](yield_context yield) {
     boost::system::error_code ec;
     ip::tcp::acceptor acceptor{service};
     acceptor.open(endpoint.protocol(), ec);
@@ -488,6 +1912,8 @@ void accept(reference_wrapper<io_service> service, Args &&... args) {
       return;
     }
     acceptor.set_option(socket_base::reuse_address{true});
+    if (reuse_port)
+      acceptor.set_option(connection_detail::reuse_port{true});
     acceptor.bind(endpoint, ec);
     if (ec) {
       clog << ec.message() << '\n';
@@ -498,22 +1924,48 @@ void accept(reference_wrapper<io_service> service, Args &&... args) {
          << "; Start listening for connections: " << ec.message() << '\n';
     if (ec)
       return;
-    while (true) {
-      auto conn = make_shared<connection<Handler>>(
-          service, typename connection<Handler>::private_construction_tag{});
-      acceptor.async_accept(conn->socket, yield[ec]);
-      clog << "Thread: " << this_thread::get_id()
-           << "; Accepted connection: " << ec.message() << '\n';
-      if (ec)
-        break;
-      if constexpr (connection<Handler>::reports_accept)
-        conn->handler.report_accept(chrono::system_clock::now());
-      spawn(service.get(),
-            [conn = move(conn)](yield_context yield) { conn->serve(yield); },
-            boost::coroutines::attributes{16 << 10});
-    }
+    accept_loop<Handler>(service, acceptor, yield);
   },
-        boost::coroutines::attributes{8 << 10});
+        pooled_stack{8 << 10});
+}
+
+template <typename Handler, typename... Args>
+void accept(reference_wrapper<io_service> service, Args &&... args) {
+  listen_on<Handler>(service, ip::tcp::endpoint(args...), false);
+}
+
+// Accepts on a listener of its own, which it closes when done.
+template <typename Handler>
+void accept(reference_wrapper<io_service> service,
+            inherited_listener listener) {
+  spawn(service.get(), [ service, listener ](yield_context yield) {
+    boost::system::error_code ec;
+    ip::tcp::acceptor acceptor{service};
+    acceptor.assign(listener.protocol, listener.descriptor, ec);
+    clog << "Thread: " << this_thread::get_id()
+         << "; Accept on inherited listener: " << ec.message() << '\n';
+    if (ec)
+      return;
+    accept_loop<Handler>(service, acceptor, yield);
+  },
+        pooled_stack{8 << 10});
+}
+
+template <typename Handler>
+void accept(io_pool &pool, inherited_listener listener) {
+  for (size_t i = 0; i < pool.size(); ++i)
+    accept<Handler>(pool[i], inherited_listener{listener.protocol,
+                                                dup(listener.descriptor)});
+  close(listener.descriptor);
+}
+
+// Listens on every io_service of the pool, each with a listener of its own
+// bound to the same port through SO_REUSEPORT. The kernel spreads incoming
+// connections across the listeners.
+template <typename Handler, typename... Args>
+void accept(io_pool &pool, Args &&... args) {
+  for (size_t i = 0; i < pool.size(); ++i)
+    listen_on<Handler>(pool[i], ip::tcp::endpoint(args...), true);
 }
 
 template <typename Handler> class client_connection {
@@ -550,9 +2002,9 @@ client_connection<Handler> connect(reference_wrapper<io_service> service,
   auto conn = make_shared<connection<Handler>>(
       service, typename connection<Handler>::private_construction_tag{});
 
-  ++conn->ticket;
+  // Requests queue behind the connect and go out once it completes.
   spawn(service.get(),
-        [ service, conn,
+        [ service, conn, slot = conn->reserve(),
           endpoint = ip::tcp::endpoint(args...) ](yield_context yield) {
           boost::system::error_code ec;
           ip::tcp::resolver resolver{service};
@@ -560,18 +2012,17 @@ client_connection<Handler> connect(reference_wrapper<io_service> service,
           clog << "Thread: " << this_thread::get_id()
                << "; Resolved address: " << ec.message() << '\n';
           if (ec)
-            return;
+            return conn->fill(slot, nullptr);
           auto connected = async_connect(conn->socket, resolved, yield[ec]);
           clog << "Thread: " << this_thread::get_id()
                << "; Connected to endpoint: " << endpoint << " " << ec.message()
                << '\n';
-          if (ec)
-            return;
           if constexpr (connection<Handler>::reports_connect)
-            conn->handler.report_connect(chrono::system_clock::now());
-          ++conn->serving;
+            if (!ec)
+              conn->handler.report_connect(chrono::system_clock::now());
+          conn->fill(slot, nullptr);
         },
-        boost::coroutines::attributes{8 << 10});
+        pooled_stack{8 << 10});
 
   return {move(conn)};
 }
@@ -611,5 +2062,17 @@ using connection_detail::accept;
 using connection_detail::connect;
 using connection_detail::upgrade;
 using connection_detail::wsconnect;
+using connection_detail::stack_pool;
+using connection_detail::worker_pool;
+using connection_detail::io_pool;
+using connection_detail::inherited_listener;
+using connection_detail::flow_limits;
+using connection_detail::write_batching;
+using connection_detail::reply_fragmenting;
+using connection_detail::connection_timeouts;
+using connection_detail::timeout_kind;
+using connection_detail::timer_wheel;
+using connection_detail::connection_memory;
+using connection_detail::connection_pool;
 } // namespace n2w
 #endif
\ No newline at end of file
@@ -3,7 +3,8 @@
 
 #include "native-2-web-common.hpp"
 #include "native-2-web-manglespec.hpp"
-#include <codecvt>
+#include "native-2-web-transcode.hpp"
+#include <stdexcept>
 
 namespace n2w {
 namespace deserialize_detail {
@@ -16,14 +17,37 @@ template <typename I, typename T> I deserialize(I i, T &t) {
   return i;
 }
 
+// Throws truncated_input unless n more bytes can be read from i. Only a
+// bounded_input knows where its buffer ends, other inputs are trusted.
+template <typename I> void need(const I &i, size_t n) {
+  if
+    constexpr(is_same_v<I, bounded_input>) {
+      if (i.remaining() < n)
+        throw truncated_input{};
+    }
+}
+
+// How many elements to make room for ahead of decoding count of them, which
+// for untrusted input is no more than there are bytes left.
+template <typename I> size_t plausible_count(const I &i, uint32_t count) {
+  if
+    constexpr(is_same_v<I, bounded_input>) return min<size_t>(
+        count, i.remaining());
+  else
+    return count;
+}
+
 template <typename T, typename I> T deserialize_number(I &i) {
   static_assert(is_arithmetic<T>::value, "Not an arithmetic type");
   // static_assert(is_same<uint8_t, remove_reference_t<decltype(*i)>>::value,
   // "Not dereferenceable or uint8_t iterator");
 
   T t = 0;
+  need(i, serial_size<T>);
   copy_n(i, serial_size<T>, reinterpret_cast<uint8_t *>(&t));
   i += serial_size<T>;
+  if
+    constexpr(wire_swapped<T>) t = reverse_endian(t);
   return t;
 }
 
@@ -35,16 +59,64 @@ void deserialize_numbers(uint32_t count, I &i, J j) {
   // static_assert(is_same<T, remove_reference_t<decltype(*j)>>::value,
   // "Output iterator does not dereference T");
 
-  generate_n(j, count, [&i]() { return deserialize_number<T>(i); });
+  if
+    constexpr(is_contiguous_input<I> && is_contiguous_output<J, T> &&
+              serial_size<T> == sizeof(T)) {
+      if (!count)
+        return;
+      need(i, count * serial_size<T>);
+      auto t = contiguous_output<J>::claim(j, count);
+      memcpy(t, &*i, count * serial_size<T>);
+      i += count * serial_size<T>;
+      if
+        constexpr(wire_swapped<T>)
+            reverse_endian_n<T>(reinterpret_cast<uint8_t *>(t), count);
+    }
+  else
+    generate_n(j, count, [&i]() { return deserialize_number<T>(i); });
+}
+
+// Scatters the wire images of count fixed layout values, see layout_plan.
+template <typename T, typename I>
+void deserialize_fixed(size_t count, I &i, T *t) {
+  auto &plan = fixed_layout_plan<T>();
+  auto to = reinterpret_cast<uint8_t *>(t);
+  auto end = to + count * sizeof(T);
+  if
+    constexpr(is_contiguous_input<I>) {
+      if (!count)
+        return;
+      need(i, count * plan.size);
+      auto from = reinterpret_cast<const uint8_t *>(&*i);
+      if (plan.dense)
+        memcpy(to, from, count * plan.size);
+      else
+        for (; to != end; to += sizeof(T))
+          from = plan.scatter(from, to);
+      i += count * plan.size;
+    }
+  else
+    for (; to != end; to += sizeof(T))
+      for (auto &run : plan.runs) {
+        need(i, run.second);
+        copy_n(i, run.second, to + run.first);
+        i += run.second;
+      }
 }
 
 template <typename T, typename I, typename J>
 void deserialize_objects(uint32_t count, I &i, J j) {
-  generate_n(j, count, [&i]() {
-    T t;
-    deserializer<T>::deserialize(i, t);
-    return t;
-  });
+  if
+    constexpr(layout<T>::fixed && is_contiguous_output<J, T>) {
+      if (count)
+        deserialize_fixed(count, i, contiguous_output<J>::claim(j, count));
+    }
+  else
+    generate_n(j, count, [&i]() {
+      T t;
+      deserializer<T>::deserialize(i, t);
+      return t;
+    });
 }
 
 template <typename T, typename I, typename J>
@@ -63,21 +135,52 @@ void deserialize_sequence(I &i, J j) {
   deserialize_sequence<T>(count, i, j, is_arithmetic<T>{});
 }
 
+template <typename C, typename = void> constexpr bool is_reservable = false;
+template <typename C>
+constexpr bool is_reservable<C, void_t<decltype(declval<C &>().reserve(0))>> =
+    true;
+
+// Appends the next count elements to c. Elements of push back sequences are
+// deserialized where they end up. Ordered containers were serialized in
+// order, so every element goes in at the end.
+template <typename T, typename I, typename C>
+void deserialize_elements(uint32_t count, I &i, C &c) {
+  if
+    constexpr(is_reservable<C>) c.reserve(c.size() +
+                                          plausible_count(i, count));
+  if
+    constexpr(!is_pushback_sequence<C>) {
+      for (auto end = count, n = 0u; n < end; ++n) {
+        T t;
+        deserializer<T>::deserialize(i, t);
+        c.emplace_hint(c.end(), move(t));
+      }
+    }
+  else if
+    constexpr(is_arithmetic<T>{} || layout<T>::fixed)
+        deserialize_sequence<T>(count, i, back_inserter(c), is_arithmetic<T>{});
+  else
+    for (auto end = count, n = 0u; n < end; ++n) {
+      c.emplace_back();
+      deserializer<T>::deserialize(i, c.back());
+    }
+}
+
+// Keys come first, then the values in the same order, each of which is
+// deserialized straight into its entry.
 template <typename T, typename U, typename I, typename A>
 void deserialize_associative(I &i, A &a) {
   auto count = deserialize_number<uint32_t>(i);
   vector<T> v_t;
-  v_t.reserve(count);
-  vector<U> v_u;
-  v_u.reserve(count);
+  v_t.reserve(plausible_count(i, count));
   deserialize_sequence<T>(count, i, back_inserter(v_t), is_arithmetic<T>{});
-  deserialize_sequence<U>(count, i, back_inserter(v_u), is_arithmetic<U>{});
-  a = inner_product(begin(v_t), end(v_t), begin(v_u), a,
-                    [](A &a, pair<T, U> p) {
-                      a.emplace(p);
-                      return a;
-                    },
-                    [](T &t, U &u) { return make_pair(t, u); });
+  if
+    constexpr(is_reservable<A>) a.reserve(a.size() + v_t.size());
+  for (auto &t : v_t) {
+    auto entry = a.emplace_hint(a.end(), piecewise_construct,
+                                forward_as_tuple(move(t)), forward_as_tuple());
+    deserializer<U>::deserialize(i, entry->second);
+  }
 }
 
 template <typename T, typename I> int deserialize_index(I &i, T &t) {
@@ -98,27 +201,8 @@ template <typename T> struct deserializer {
     if
       constexpr(is_void_v<T> || is_same_v<T, void *>);
     else if
-      constexpr(is_same_v<T, char16_t>) {
-        struct cvt32 : codecvt<char32_t, char, mbstate_t> {};
-        wstring_convert<cvt32, char32_t> cvter32;
-        u32string c32s;
-        c32s += deserialize_number<char32_t>(i);
-        auto cs = cvter32.to_bytes(c32s);
-
-        struct cvt16 : codecvt<char16_t, char, mbstate_t> {};
-        wstring_convert<cvt16, char16_t> cvter16;
-        auto ts = cvter16.from_bytes(cs);
-        t = ts[0];
-      }
-    else if
-      constexpr(is_same_v<T, wchar_t>) {
-        char s[sizeof(char32_t)];
-        auto n = min(utflen(*i), sizeof(s));
-        copy_n(i, n, s);
-        i += n;
-        mbstate_t state;
-        mbrtowc(&t, s, n, &state);
-      }
+      constexpr(is_same_v<T, char16_t> || is_same_v<T, wchar_t>) t =
+          from_code_point<T>(deserialize_number<char32_t>(i));
     else if
       constexpr(is_enum_v<T>) {
         underlying_type_t<T> u;
@@ -131,13 +215,8 @@ template <typename T> struct deserializer {
       constexpr(is_heterogenous<T>) deserialize_heterogenous(
           i, t, make_index_sequence<tuple_size_v<T>>{});
     else if
-      constexpr(is_sequence<T>) {
-        if
-          constexpr(is_pushback_sequence<T>)
-              deserialize_sequence<typename T::value_type>(i, back_inserter(t));
-        else
-          deserialize_sequence<typename T::value_type>(i, inserter(t, end(t)));
-      }
+      constexpr(is_sequence<T>) deserialize_elements<typename T::value_type>(
+          deserialize_number<uint32_t>(i), i, t);
     else if
       constexpr(is_associative<T>)
           deserialize_associative<typename T::key_type,
@@ -149,6 +228,11 @@ template <typename T, size_t N> struct deserializer<T[N]> {
     deserialize_sequence<T>(N, i, t, is_arithmetic<T>{});
   }
 };
+template <typename T, size_t N> struct deserializer<array<T, N>> {
+  template <typename I> static void deserialize(I &i, array<T, N> &t) {
+    deserialize_sequence<T>(N, i, t.data(), is_arithmetic<T>{});
+  }
+};
 template <typename T, size_t M, size_t N> struct deserializer<T[M][N]> {
   template <typename I> static void deserialize(I &i, T (&t)[M][N]) {
     deserializer<T[M * N]>::deserialize(i, reinterpret_cast<T(&)[M * N]>(t));
@@ -158,18 +242,68 @@ template <typename T, typename... Traits>
 struct deserializer<basic_string<T, Traits...>> {
   template <typename I>
   static void deserialize(I &i, basic_string<T, Traits...> &t) {
-    string utf8;
-    deserialize_sequence<char>(i, back_inserter(utf8));
+    deserialize_utf8(deserialize_number<uint32_t>(i), i, t);
+  }
+  // Reads count bytes of UTF-8 into t.
+  template <typename I>
+  static void deserialize_utf8(uint32_t count, I &i,
+                               basic_string<T, Traits...> &t) {
     if
-      constexpr(!is_same<T, char>{}) {
-        wstring_convert<codecvt_utf8<T>, T> cvter{
-            "Could not convert from " +
-            mangled<basic_string<char, Traits...>>() + " to " +
-            mangled<basic_string<T, Traits...>>()};
-        t = cvter.from_bytes(utf8);
+      constexpr(is_same<T, char>{}) {
+        t.clear();
+        deserialize_sequence<char>(count, i, back_inserter(t), true_type{});
       }
-    else
-      t = utf8;
+    else {
+      bool valid;
+      if
+        constexpr(is_contiguous_input<I>) {
+          need(i, count);
+          valid = from_utf8(
+              count ? reinterpret_cast<const uint8_t *>(&*i) : nullptr, count,
+              t);
+          i += count;
+        }
+      else {
+        string utf8;
+        deserialize_sequence<char>(count, i, back_inserter(utf8), true_type{});
+        valid = from_utf8(reinterpret_cast<const uint8_t *>(utf8.data()),
+                          count, t);
+      }
+      if (!valid) {
+        static const string error = "Could not convert from " +
+                                    mangled<basic_string<char, Traits...>>() +
+                                    " to " +
+                                    mangled<basic_string<T, Traits...>>();
+        throw range_error{error};
+      }
+    }
+  }
+};
+// Views alias the buffer being deserialized instead of copying out of it, so
+// that buffer has to outlive them.
+template <typename T, typename... Traits>
+struct deserializer<basic_string_view<T, Traits...>> {
+  static_assert(is_same<T, char>{}, "Only UTF-8 string views are supported");
+  template <typename I>
+  static void deserialize(I &i, basic_string_view<T, Traits...> &t) {
+    static_assert(is_contiguous_input<I>, "Views need a contiguous buffer");
+    auto count = deserialize_number<uint32_t>(i);
+    need(i, count);
+    t = count ? basic_string_view<T, Traits...>{reinterpret_cast<const T *>(
+                                                    &*i),
+                                                count}
+              : basic_string_view<T, Traits...>{};
+    i += count;
+  }
+};
+template <typename T> struct deserializer<numbers_view<T>> {
+  template <typename I> static void deserialize(I &i, numbers_view<T> &t) {
+    static_assert(is_contiguous_input<I>, "Views need a contiguous buffer");
+    auto count = deserialize_number<uint32_t>(i);
+    need(i, size_t{count} * serial_size<T>);
+    t = count ? numbers_view<T>{reinterpret_cast<const uint8_t *>(&*i), count}
+              : numbers_view<T>{};
+    i += count * serial_size<T>;
   }
 };
 template <typename S, typename T, typename... Ts, typename... Bs>
@@ -181,10 +315,62 @@ struct deserializer<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
   template <typename I>
   static void deserialize(I &i,
                           structure<S, tuple<T, Ts...>, tuple<Bs...>> &t) {
-    initializer_list<int> rc = {
-        deserialize(i, *static_cast<Bs *>(t.s_write))...};
-    (void)rc;
-    deserialize_heterogenous(i, t, make_index_sequence<sizeof...(Ts) + 1>{});
+    if
+      constexpr(layout<S>::fixed) deserialize_fixed(1, i, t.s_write);
+    else {
+      initializer_list<int> rc = {
+          deserialize(i, *static_cast<Bs *>(t.s_write))...};
+      (void)rc;
+      deserialize_heterogenous(i, t, make_index_sequence<sizeof...(Ts) + 1>{});
+    }
+  }
+};
+// Reads back what column_writer writes, see native-2-web-serialize.hpp.
+template <typename R, typename I> struct column_reader {
+  vector<R> &rows;
+  I &i;
+  size_t offset;
+  template <typename F, typename P> void column(P project) {
+    if
+      constexpr(is_arithmetic_v<F> || is_enum_v<F>) {
+        using N = column_number_t<F>;
+        auto padding = column_padding<N>(offset);
+        i += padding;
+        offset += padding + rows.size() * serial_size<N>;
+        for (auto &r : rows)
+          if
+            constexpr(is_same_v<F, char16_t> || is_same_v<F, wchar_t>)
+                project(r) = from_code_point<F>(deserialize_number<N>(i));
+          else
+            project(r) = static_cast<F>(deserialize_number<N>(i));
+      }
+    else if
+      constexpr(is_string_column<F>) {
+        auto padding = column_padding<uint32_t>(offset);
+        i += padding;
+        vector<uint32_t> ends(rows.size() + 1);
+        for (auto &end : ends)
+          end = deserialize_number<uint32_t>(i);
+        for (size_t k = 0; k < rows.size(); ++k)
+          deserializer<F>::deserialize_utf8(ends[k + 1] - ends[k], i,
+                                            project(rows[k]));
+        offset += padding + ends.size() * serial_size<uint32_t> + ends.back();
+      }
+    else
+      for (auto &r : rows) {
+        auto begin = i;
+        deserializer<F>::deserialize(i, project(r));
+        offset += i - begin;
+      }
+  }
+};
+
+template <typename T> struct deserializer<columns<T>> {
+  template <typename I> static void deserialize(I &i, columns<T> &t) {
+    t.clear();
+    t.resize(deserialize_number<uint32_t>(i));
+    column_reader<T, I> reader{t, i, serial_size<uint32_t>};
+    for_each_column<T>([](auto &r) -> auto & { return r; }, reader);
   }
 };
 template <typename T> struct deserializer<optional<T>> {
@@ -69,7 +69,7 @@ template <typename T> struct to_js {
   }
   template <typename U = T>
   static auto create_html() -> enable_if_t<is_enum<U>{}, string> {
-    auto e_to_str = enumeration<U>::e_to_str();
+    auto &e_to_str = enumeration<U>::e_to_str();
     return R"(function (parent, value, dispatcher) {
   this.signature = ')" +
            regex_replace(mangled<U>(), regex{"'"}, "\\'") +
@@ -278,6 +278,9 @@ template <typename T, typename... Traits> struct to_js<vector<T, Traits...>> {
   }
 };
 
+template <typename T, typename... Traits>
+struct to_js<basic_string_view<T, Traits...>> : to_js<basic_string<T>> {};
+template <typename T> struct to_js<numbers_view<T>> : to_js<vector<T>> {};
 template <typename T, typename... Traits>
 struct to_js<list<T, Traits...>> : to_js<vector<T>> {};
 template <typename T, typename... Traits>
@@ -531,7 +534,7 @@ struct to_js<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
 
 template <typename S, typename T, typename... Ts, typename... Bs>
 string to_js<structure<S, tuple<T, Ts...>, tuple<Bs...>>>::names() {
-  auto names = structure<S, tuple<T, Ts...>, tuple<Bs...>>::names();
+  auto &names = structure<S, tuple<T, Ts...>, tuple<Bs...>>::names();
   return "let names = [" + accumulate(cbegin(names) + 1, cend(names), string{},
                                       [](auto names, const auto &name) {
                                         return names +
@@ -543,7 +546,8 @@ string to_js<structure<S, tuple<T, Ts...>, tuple<Bs...>>>::names() {
 
 template <typename S, typename T, typename... Ts, typename... Bs>
 string to_js<structure<S, tuple<T, Ts...>, tuple<Bs...>>>::base_names() {
-  auto base_names = structure<S, tuple<T, Ts...>, tuple<Bs...>>::base_names();
+  auto &base_names =
+      structure<S, tuple<T, Ts...>, tuple<Bs...>>::base_names();
   return "let base_names = [" +
          accumulate(cbegin(base_names), cend(base_names), string{},
                     [](auto names, const auto &name) {
@@ -553,6 +557,95 @@ string to_js<structure<S, tuple<T, Ts...>, tuple<Bs...>>>::base_names() {
          "];\n";
 }
 
+// Readers of the columns of a T, see for_each_column. They take the row count
+// and where the columns start on top of the usual data and offset.
+template <typename T> struct to_js_columns {
+  static string create_reader() {
+    if
+      constexpr(is_reflected<T>) return to_js_columns<
+          typename reflection<T>::view>::create_reader();
+    else if
+      constexpr(is_heterogenous<T> && !is_std_array<T>) return
+          create_reader(make_index_sequence<tuple_size_v<T>>{});
+    else if
+      constexpr(is_arithmetic_v<T> || is_enum_v<T>) return
+          R"(function (data, offset, size, origin) {
+  return read_column(data, offset, ')" +
+          js_constructor<column_number_t<T>> + R"(', size, origin);
+})";
+    else if
+      constexpr(is_string_column<T>) return "read_string_column";
+    else
+      return R"(function (data, offset, size) {
+  return read_structures_bounded(data, offset, )" +
+             to_js<T>::create_reader() + R"(, size);
+})";
+  }
+  template <size_t... Is> static string create_reader(index_sequence<Is...>) {
+    string readers;
+    for (auto &reader : initializer_list<string>{
+             to_js_columns<tuple_element_t<Is, T>>::create_reader()...})
+      readers += (readers.empty() ? "" : ",\n") + reader;
+    constexpr bool is_pair = is_same_v<
+        T, pair<tuple_element_t<0, T>, tuple_element_t<1, T>>>;
+    return R"(function (data, offset, size, origin) {
+  let column = r => (data, offset) => r(data, offset, size, origin);
+  return read_structure(data, offset, [)" +
+           readers + R"(].map(column))" +
+           (is_pair ? R"(, ['first', 'second'])" : "") + R"();
+})";
+  }
+};
+
+template <typename S, typename T, typename... Ts, typename... Bs>
+struct to_js_columns<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
+  using view = structure<S, tuple<T, Ts...>, tuple<Bs...>>;
+  static string create_reader() {
+    string base_readers;
+    for (auto &readers :
+         initializer_list<string>{to_js_columns<Bs>::create_reader()...})
+      base_readers += (base_readers.empty() ? "" : ",") + readers;
+    string readers;
+    for (auto &reader : initializer_list<string>{
+             to_js_columns<T>::create_reader(),
+             to_js_columns<Ts>::create_reader()...})
+      readers += (readers.empty() ? "" : ",\n") + reader;
+    return R"(function (data, offset, size, origin) {
+  )" + to_js<view>::base_names() +
+           to_js<view>::names() +
+           R"(let column = r => (data, offset) => r(data, offset, size, origin);
+  return read_structure(data, offset, [)" +
+           readers + R"(].map(column), names, [)" + base_readers +
+           R"(].map(column), base_names);
+})";
+  }
+};
+
+// Number columns read as typed arrays over the received data, strings as
+// arrays of strings. There is no writer, columns only come back from services.
+template <typename T> struct to_js<columns<T>> {
+  static string create_reader() {
+    return R"(function (data, offset) {
+  return read_columns(data, offset, )" +
+           to_js_columns<T>::create_reader() + R"();
+})";
+  }
+  static string create_writer() {
+    return R"(function (object) {
+  throw new Error('Columns cannot be written: )" +
+           regex_replace(mangled<columns<T>>(), regex{"'"}, "\\'") + R"(');
+})";
+  }
+  static string create_html() {
+    return R"(function (parent, value, dispatcher) {
+  if (this.prefill)
+    this.prefill = columns_to_rows(this.prefill);
+  return ()" +
+           to_js<vector<T>>::create_html() + R"()(parent, value, dispatcher);
+}.bind(this))";
+  }
+};
+
 template <typename T> struct to_js<optional<T>> {
   static string create_reader() {
     return R"(function (data, offset) {
@@ -15,10 +15,19 @@ template <typename...> struct mangle_prefix {
   static string value() { return terminate_processing; }
 };
 
-template <typename T> string mangled() {
-  return mangle<remove_cv_t<remove_reference_t<T>>>::value();
+// Each mangled name is built once, the first time it is asked for.
+template <typename T> const string &mangled() {
+  using U = remove_cv_t<remove_reference_t<T>>;
+  if
+    constexpr(!is_same_v<T, U>) return mangled<U>();
+  else {
+    static const string mangled = mangle<T>::value();
+    return mangled;
+  }
+}
+template <typename T> const string &mangled(const T &&) {
+  return mangled<T>();
 }
-template <typename T> string mangled(const T &&) { return mangled<T>(); }
 
 template <typename T> string mangle_prefixed() {
   return mangle_prefix<remove_cv_t<remove_reference_t<T>>>::value();
@@ -65,6 +74,9 @@ template <typename T, typename... Traits>
 struct mangle_prefix<vector<T, Traits...>> {
   static string value() { return "v["; }
 };
+template <typename T> struct mangle_prefix<columns<T>> {
+  static string value() { return "C["; }
+};
 template <typename T, typename... Traits>
 struct mangle_prefix<list<T, Traits...>> {
   static string value() { return "l["; }
@@ -223,11 +235,17 @@ struct mangle<basic_string<T, Traits...>> {
     return mangle_prefixed<basic_string<T, Traits...>>() + mangled<T>();
   }
 };
+template <typename T, typename... Traits>
+struct mangle<basic_string_view<T, Traits...>> : mangle<basic_string<T>> {};
+template <typename T> struct mangle<numbers_view<T>> : mangle<vector<T>> {};
 template <typename T, typename... Traits> struct mangle<vector<T, Traits...>> {
   static string value() {
     return mangle_prefixed<vector<T, Traits...>>() + mangled<T>();
   }
 };
+template <typename T> struct mangle<columns<T>> {
+  static string value() { return mangle_prefixed<columns<T>>() + mangled<T>(); }
+};
 template <typename T, typename... Traits> struct mangle<list<T, Traits...>> {
   static string value() {
     return mangle_prefixed<list<T, Traits...>>() + mangled<T>();
@@ -305,7 +323,7 @@ struct mangle<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
 
 template <typename E> struct mangle<enumeration<E>> {
   static string value() {
-    auto e_to_str = enumeration<E>::e_to_str();
+    auto &e_to_str = enumeration<E>::e_to_str();
     return mangle_prefixed<E>() + mangled<underlying_type_t<E>>() +
            accumulate(cbegin(e_to_str), cend(e_to_str), string{},
                       [](auto s, auto e) {
@@ -376,7 +394,8 @@ template <> struct mangle<filesystem::space_info> {
   template <> struct mangle<s> : mangle<c> {};                                 \
   }
 
-template <bool e = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__>
+// The byte order of numbers on the wire, whatever the host's.
+template <bool e = little_endian_wire>
 string endianness = e ? "e" : "E";
 
 template <typename R, typename... Ts> struct mangle<R(Ts...)> {
@@ -5,8 +5,11 @@
 #include "native-2-web-js.hpp"
 #include "native-2-web-readwrite.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <exception>
 #include <experimental/filesystem>
-#include <regex>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <unordered_map>
@@ -14,10 +17,17 @@
 #include <vector>
 
 namespace n2w {
+// The rows columns are made of for the rows a service returns. Rows with no
+// members to reflect specialize it to a record of what their wire form
+// carries.
+template <typename T> struct column_row { using type = T; };
+
 namespace plugin_detail {
 using namespace std;
 template <typename F> struct func;
 template <typename Ret, typename... Args> struct func<Ret(Args...)> {
+  // Only references and qualifiers are stripped: string_view and numbers_view
+  // parameters stay views into the request buffer.
   using args_t =
       conditional_t<(sizeof...(Args) > 0), tuple<decay_t<Args>...>, void *>;
   using ret_t = conditional_t<is_void<Ret>{}, void *, Ret>;
@@ -25,6 +35,19 @@ template <typename Ret, typename... Args> struct func<Ret(Args...)> {
   static auto function_address(const char *name) {
     return n2w::function_address(name, static_cast<Ret (*)(Args...)>(nullptr));
   };
+  // Wraps the callback to return its vector as columns, see column_row.
+  template <typename C> static auto columnar(C callback) {
+    using row = typename decay_t<Ret>::value_type;
+    return [callback](Args... args) mutable
+           -> columns<typename column_row<row>::type> {
+      auto rows = callback(forward<Args>(args)...);
+      if constexpr (is_same_v<typename column_row<row>::type, row>)
+        return rows;
+      else
+        return columns<typename column_row<row>::type>(cbegin(rows),
+                                                       cend(rows));
+    };
+  }
 };
 template <typename Ret, typename... Args>
 struct func<Ret (*)(Args...)> : func<Ret(Args...)> {};
@@ -40,21 +63,54 @@ template <typename Ret, typename T, typename... Args>
 struct func<Ret (T::*)(Args...) const volatile> : func<Ret(Args...)> {};
 template <typename F> struct func : func<decltype(&decay_t<F>::operator())> {};
 
+// The arguments of a stream service before the byte_source it takes last.
+template <typename Args, typename Is> struct leading_args;
+template <typename... Args, size_t... Is>
+struct leading_args<tuple<Args...>, index_sequence<Is...>> {
+  using type = conditional_t<(sizeof...(Is) > 0),
+                             tuple<tuple_element_t<Is, tuple<Args...>>...>,
+                             void *>;
+};
+
+// Asks register_service for the columnar encoding of the vector a service
+// returns, see columns.
+constexpr struct columnar_t {
+} columnar{};
+
+// Where the server runs a service, chosen at register_service: on the
+// coroutine that read the call, for services quick enough not to hold up the
+// reads behind them; in a coroutine of its own on the io threads; or on the
+// worker pool, for services that compute or block for long.
+enum class placement { inline_call, io, worker };
+
 class plugin_impl {
 protected:
   using buf_type = vector<uint8_t>;
+  using buf_view = numbers_view<uint8_t>;
+  // Decodes the arguments from a view and serializes the result behind
+  // `headroom` bytes, which the caller can fill with its reply envelope.
+  using function_type = function<buf_type(buf_view, size_t)>;
+  // The same for stream services, which also read the source of their last
+  // argument.
+  using stream_function_type =
+      function<buf_type(buf_view, size_t, byte_source &)>;
   template <typename F> using args_t = typename func<F>::args_t;
   template <typename F> using ret_t = typename func<F>::ret_t;
+  template <typename F>
+  using stream_args_t = typename leading_args<
+      args_t<F>, make_index_sequence<tuple_size_v<args_t<F>> - 1>>::type;
 
   unordered_map<string, string> pointer_to_name;
   unordered_map<string, string> name_to_readable;
   unordered_map<string, string> pointer_to_description;
-  unordered_map<string, function<buf_type(const buf_type &)>>
-      pointer_to_function;
+  unordered_map<string, function_type> pointer_to_function;
+  unordered_map<string, stream_function_type> pointer_to_stream_function;
   unordered_map<string, string> pointer_to_javascript;
   unordered_map<string, string> pointer_to_generator;
 
   unordered_set<string> services;
+  unordered_map<string, placement> pointer_to_placement;
+  unordered_set<string> stream_services;
   unordered_set<string> push_notifiers;
   unordered_set<string> kaonashis;
 };
@@ -62,32 +118,59 @@ protected:
 class plugin : private basic_plugin, public plugin_impl {
   template <size_t... Is, typename R, typename W, typename C>
   static auto generic_caller(R &&reader, W &&writer, C &&callback) {
-    return [reader, writer, callback](const buf_type &in) mutable -> buf_type {
+    return [reader, writer, callback](buf_view in,
+                                      size_t headroom) mutable -> buf_type {
+      // Decode the whole argument tuple once, then hand each element over.
+      // View arguments alias `in`, which outlives the callback.
+      [[maybe_unused]] auto args = reader(in);
       if
         constexpr(is_same_v<ret_t<C>, void *>) {
-          callback(get<Is>(reader(in))...);
-          return writer(nullptr);
+          callback(get<Is>(move(args))...);
+          return writer(nullptr, headroom);
         }
       else
-        return writer(callback(get<Is>(reader(in))...));
+        return writer(callback(get<Is>(move(args))...), headroom);
     };
   }
+  template <typename R>
+  static buf_type write_result(const R &return_val, size_t headroom) {
+    buf_type buf(headroom + serialized_size(return_val));
+    auto end = serialize(return_val, buf.data() + headroom);
+    assert(end == buf.data() + buf.size() &&
+           "serialized_size disagrees with serialize");
+    (void)end;
+    return buf;
+  }
   template <typename F, size_t... Is>
   static auto create_caller(F &&callback, index_sequence<Is...>) {
     using args_type = args_t<F>;
     using ret_type = ret_t<F>;
-    auto reader = [](const buf_type &in) -> args_type {
+    auto reader = [](buf_view in) -> args_type {
       args_type args;
-      deserialize(cbegin(in), args);
+      deserialize(bounded_input{in.data(), in.size()}, args);
       return args;
     };
-    auto writer = [](const ret_t<F> &return_val) -> buf_type {
-      buf_type buf;
-      serialize(return_val, back_inserter(buf));
-      return buf;
+    auto writer = [](const ret_t<F> &return_val, size_t headroom) -> buf_type {
+      return write_result(return_val, headroom);
     };
     return generic_caller<Is...>(reader, writer, callback);
   }
+  template <typename F, size_t... Is>
+  static auto create_stream_caller(F &&callback, index_sequence<Is...>) {
+    return [callback](buf_view in, size_t headroom,
+                      byte_source &source) mutable -> buf_type {
+      stream_args_t<F> args;
+      deserialize(bounded_input{in.data(), in.size()}, args);
+      if
+        constexpr(is_same_v<ret_t<F>, void *>) {
+          callback(get<Is>(move(args))..., source);
+          return write_result<void *>(nullptr, headroom);
+        }
+      else
+        return write_result(callback(get<Is>(move(args))..., source),
+                            headroom);
+    };
+  }
 
   // cd, search through names, then descriptions, using the following strategy:
   // Exact match, starting from the beginning.
@@ -102,8 +185,8 @@ class plugin : private basic_plugin, public plugin_impl {
   // Suggest next character to quickly differentiate.
   // Case insensitive.
 
-  // TODO: Push notifications on same websocket requires all services to
-  // generate request ids to differentiate between requests and notifications.
+  // TODO: Push notifications on the same websocket need request ids apart
+  // from the ones calls take.
 
   template <typename F>
   void register_api(const char *name, F &&callback, const char *description) {
@@ -115,6 +198,9 @@ class plugin : private basic_plugin, public plugin_impl {
   }
 
 public:
+  using plugin_impl::function_type;
+  using plugin_impl::stream_function_type;
+
   plugin() : basic_plugin(nullptr) {}
 
   // TODO: Register service.
@@ -122,16 +208,14 @@ public:
   // TODO: Register kaonashi.
 
   template <typename F>
-  void register_service(const char *name, F &&callback,
-                        const char *description) {
+  void register_service(const char *name, F &&callback, const char *description,
+                        placement where = placement::io) {
     register_api(name, callback, description);
     services.emplace(func<F>::function_address(name));
+    pointer_to_placement[func<F>::function_address(name)] = where;
     pointer_to_javascript[func<F>::function_address(name)] =
-        R"(create_service(')" +
-        regex_replace(func<F>::function_address(name), regex{"'"},
-                      R"(\')") +
-        R"(', )" + to_js<args_t<F>>::create_writer() + R"(, )" +
-        to_js<ret_t<F>>::create_reader() + R"())";
+        to_js<args_t<F>>::create_writer() + R"(, )" +
+        to_js<ret_t<F>>::create_reader();
 
     pointer_to_generator[func<F>::function_address(name)] =
         R"(function (parent, executor) {
@@ -144,6 +228,33 @@ public:
 })";
   }
   template <typename F>
+  void register_service(const char *name, F &&callback, const char *description,
+                        columnar_t, placement where = placement::io) {
+    using R = decay_t<ret_t<F>>;
+    static_assert(is_same_v<R, vector<typename R::value_type>>,
+                  "Only vectors can be returned as columns");
+    register_service(name, func<F>::columnar(callback), description, where);
+  }
+  // Registers a service whose last parameter is a byte_source &, for an
+  // argument too large to send in one message. Clients send it in chunks
+  // after the call, which runs on the worker pool as they arrive.
+  template <typename F>
+  void register_stream_service(const char *name, F &&callback,
+                               const char *description) {
+    const auto pointer = func<F>::function_address(name);
+    pointer_to_name[pointer] = name;
+    pointer_to_description[pointer] = description;
+    pointer_to_stream_function[pointer] = create_stream_caller(
+        callback, make_index_sequence<tuple_size_v<args_t<F>> - 1>{});
+    services.emplace(pointer);
+    stream_services.emplace(pointer);
+    pointer_to_placement[pointer] = placement::worker;
+    pointer_to_javascript[pointer] =
+        to_js<stream_args_t<F>>::create_writer() + R"(, )" +
+        to_js<ret_t<F>>::create_reader();
+    pointer_to_generator[pointer] = "null";
+  }
+  template <typename F>
   void register_push_notifier(const char *name, F &&callback,
                               const char *description) {
     register_api(name, callback, description);
@@ -169,26 +280,189 @@ public:
     return {cbegin(kaonashis), cend(kaonashis)};
   }
 
+  placement get_placement(const string &pointer) const {
+    auto found = pointer_to_placement.find(pointer);
+    return found != cend(pointer_to_placement) ? found->second : placement::io;
+  }
+
   string get_name(string pointer) { return pointer_to_name[pointer]; }
 
   string get_generator(string pointer) { return pointer_to_generator[pointer]; }
 
-  string get_javascript(string pointer) {
-    return pointer_to_javascript[pointer];
+  // Services are called by the numeric id the server assigns to them.
+  string get_javascript(string pointer, uint32_t id) {
+    return (stream_services.count(pointer) ? "create_stream_service("
+                                           : "create_service(") +
+           to_string(id) + ", " + pointer_to_javascript[pointer] + ")";
+  }
+
+  reference_wrapper<const function_type>
+  get_function(const string &pointer) const {
+    static const function_type none;
+    auto found = pointer_to_function.find(pointer);
+    return cref(found != cend(pointer_to_function) ? found->second : none);
   }
 
-  reference_wrapper<const function<buf_type(const buf_type &)>>
-  get_function(const string &pointer) {
-    return cref(pointer_to_function[pointer]);
+  const stream_function_type *get_stream_function(const string &pointer) const {
+    auto found = pointer_to_stream_function.find(pointer);
+    return found != cend(pointer_to_stream_function) ? &found->second
+                                                     : nullptr;
   }
 
   plugin(const char *dll)
       : basic_plugin(dll),
         plugin_impl(static_cast<plugin_impl>(sym<plugin>("plugin"))) {}
 };
+
+// A service as a call finds it by id, with what keeps it loaded while the
+// call runs.
+struct call_target {
+  shared_ptr<const void> keep;
+  const plugin::function_type *function = nullptr;
+  const plugin::stream_function_type *stream = nullptr;
+  placement where = placement::io;
+};
+
+// The websocket messages of calls, for the websocket_handler of a
+// connection. A call is one binary message: a uint32 request id, a uint32
+// service id, then the arguments. Its reply is the request id and a uint32
+// status followed by the result, which the header keeps 8 byte aligned.
+// Calls on one websocket run concurrently and reply as soon as they finish.
+// A large reply may come as several messages with the same request id, all
+// but the last with status partial, whose results join up into the whole
+// one. A call to a stream service puts the uint64 length of its streamed
+// argument before the other arguments. The argument follows in chunks, each
+// a message of the request id, the service id stream_chunk_id and the bytes.
+// Such a call is answered busy at once when the workers are all taken by
+// other streams, and its chunks are dropped.
+// A service that throws is answered failed.
+//
+// Services derives from it and finds services by id with
+// `call_target service(uint32_t id)`.
+template <typename Services> struct call_protocol {
+  static constexpr bool unordered_replies = true;
+  enum status : uint32_t {
+    ok,
+    unknown_service,
+    malformed_request,
+    partial,
+    busy,
+    failed
+  };
+  static constexpr size_t call_header = 2 * sizeof(uint32_t);
+  static constexpr size_t stream_header = call_header + sizeof(uint64_t);
+  static constexpr size_t reply_header = 2 * sizeof(uint32_t);
+  static constexpr uint32_t stream_chunk_id = ~uint32_t{0};
+
+  call_target find_service(const vector<uint8_t> &message) {
+    uint32_t service_id = 0;
+    if (message.size() < call_header)
+      return {};
+    deserialize(message.data() + sizeof(uint32_t), service_id);
+    return static_cast<Services &>(*this).service(service_id);
+  }
+
+  // Copies the reply header and the next bytes of the result from offset,
+  // marking the message partial unless it ends the reply.
+  vector<uint8_t> fragment(const vector<uint8_t> &reply, size_t &offset,
+                           size_t bytes) {
+    offset = max(offset, reply_header);
+    auto size = min(bytes, reply.size() - offset);
+    vector<uint8_t> message(reply_header + size);
+    copy_n(reply.data(), reply_header, message.data());
+    copy_n(reply.data() + offset, size, message.data() + reply_header);
+    offset += size;
+    if (offset < reply.size())
+      serialize(static_cast<uint32_t>(partial),
+                message.data() + sizeof(uint32_t));
+    return message;
+  }
+
+  bool opens_stream(const vector<uint8_t> &message, uint64_t &key,
+                    uint64_t &length) {
+    if (message.size() < stream_header || !find_service(message).stream)
+      return false;
+    uint32_t id = 0;
+    deserialize(message.data(), id);
+    deserialize(message.data() + call_header, length);
+    key = id;
+    return true;
+  }
+
+  bool stream_chunk(const vector<uint8_t> &message, uint64_t &key,
+                    size_t &offset) {
+    uint32_t id = 0, service_id = 0;
+    if (message.size() < call_header)
+      return false;
+    deserialize(message.data(), id);
+    deserialize(message.data() + sizeof(uint32_t), service_id);
+    if (service_id != stream_chunk_id)
+      return false;
+    key = id;
+    offset = call_header;
+    return true;
+  }
+
+  vector<uint8_t> refuse_stream(const vector<uint8_t> &message) {
+    uint32_t id = 0;
+    deserialize(message.data(), id);
+    return reply(id, vector<uint8_t>(reply_header), busy);
+  }
+
+  vector<uint8_t> operator()(vector<uint8_t> message, byte_source &source) {
+    uint32_t id = 0;
+    deserialize(message.data(), id);
+    // The target keeps the service's plugin loaded until the call returns.
+    auto target = find_service(message);
+    if (!target.stream || !*target.stream)
+      return reply(id, vector<uint8_t>(reply_header), unknown_service);
+    try {
+      return reply(id,
+                   (*target.stream)({message.data() + stream_header,
+                                     message.size() - stream_header},
+                                    reply_header, source),
+                   ok);
+    } catch (const truncated_input &) {
+      return reply(id, vector<uint8_t>(reply_header), malformed_request);
+    } catch (const exception &) {
+      return reply(id, vector<uint8_t>(reply_header), failed);
+    }
+  }
+
+  vector<uint8_t> operator()(vector<uint8_t> message) {
+    uint32_t id = 0;
+    if (message.size() < call_header)
+      return reply(id, vector<uint8_t>(reply_header), malformed_request);
+    deserialize(message.data(), id);
+    auto target = find_service(message);
+    if (!target.function || !*target.function)
+      return reply(id, vector<uint8_t>(reply_header), unknown_service);
+    try {
+      return reply(id,
+                   (*target.function)({message.data() + call_header,
+                                       message.size() - call_header},
+                                      reply_header),
+                   ok);
+    } catch (const truncated_input &) {
+      return reply(id, vector<uint8_t>(reply_header), malformed_request);
+    } catch (const exception &) {
+      return reply(id, vector<uint8_t>(reply_header), failed);
+    }
+  }
+
+private:
+  static vector<uint8_t> reply(uint32_t id, vector<uint8_t> buf, status s) {
+    serialize(make_tuple(id, static_cast<uint32_t>(s)), buf.data());
+    return buf;
+  }
+};
 }
 
 using plugin_detail::plugin;
+using plugin_detail::columnar;
+using plugin_detail::placement;
+using plugin_detail::call_target;
+using plugin_detail::call_protocol;
 
 #define N2W__DECLARE_API(x) #x, x
 }
@@ -3,6 +3,7 @@
 
 #include "native-2-web-deserialize.hpp"
 #include "native-2-web-serialize.hpp"
+#include <codecvt>
 #include <locale>
 
 #define N2W__BINARY_SPEC(s, m, ...)                                            \
@@ -128,8 +129,10 @@ template <typename T> struct printer {
   }
   template <size_t I = 0, typename O>
   static auto debug_print(O &o, T t) -> enable_if_t<is_enum<T>::value, O &> {
+    auto &e_to_str = enumeration<T>::e_to_str();
+    auto e = e_to_str.find(t);
     return o << indent<typename O::char_type, I> << enumeration<T>::type_name()
-             << ":='" << enumeration<T>::e_to_str()[t] << "'";
+             << ":='" << (e == cend(e_to_str) ? "" : e->second.c_str()) << "'";
   }
 };
 template <typename T, size_t N> struct printer<T[N]> {
@@ -168,7 +171,7 @@ struct printer<basic_string<T, Traits...>> {
   template <size_t I = 0, typename O>
   static O &debug_print(O &o, const basic_string<T, Traits...> &t) {
     struct cvt : codecvt<T, typename O::char_type, mbstate_t> {};
-    wstring_convert<cvt, T> cvter{
+    thread_local wstring_convert<cvt, T> cvter{
         "Could not convert from " + mangled<basic_string<T, Traits...>>() +
         " to " + mangled<basic_string<typename O::char_type, Traits...>>()};
     return o << indent<typename O::char_type,
@@ -182,6 +185,7 @@ template <typename T, typename... Traits> struct printer<vector<T, Traits...>> {
     return print_sequence<I>(o, t, t.size());
   }
 };
+template <typename T> struct printer<columns<T>> : printer<vector<T>> {};
 template <typename T, typename... Traits> struct printer<list<T, Traits...>> {
   template <size_t I = 0, typename O>
   static O &debug_print(O &o, const list<T, Traits...> &t) {
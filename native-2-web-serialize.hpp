@@ -3,7 +3,10 @@
 
 #include "native-2-web-common.hpp"
 #include "native-2-web-manglespec.hpp"
-#include <codecvt>
+#include "native-2-web-transcode.hpp"
+
+#include <limits>
+#include <stdexcept>
 
 namespace n2w {
 namespace serialize_detail {
@@ -21,9 +24,16 @@ template <typename T, typename I> void serialize_number(T t, I &i) {
   // static_assert(is_same<uint8_t, remove_reference_t<decltype(*i)>>::value,
   // "Not dereferenceable or uint8_t iterator");
 
+  if
+    constexpr(wire_swapped<T>) t = reverse_endian(t);
   i = copy_n(reinterpret_cast<uint8_t *>(&t), serial_size<T>, i);
 }
 
+template <typename I>
+constexpr bool is_byte_output =
+    contiguous_output<I>::value &&
+    sizeof(typename contiguous_output<I>::value_type) == 1;
+
 template <typename T, typename I, typename J>
 void serialize_numbers(uint32_t count, J j, I &i) {
   static_assert(is_arithmetic<T>::value, "Not an arithmetic type");
@@ -32,13 +42,55 @@ void serialize_numbers(uint32_t count, J j, I &i) {
   // static_assert(is_same<T, remove_reference_t<decltype(*j)>>::value,
   // "Output iterator does not dereference T");
 
-  for_each(j, j + count, [&i](const T &t) { serialize_number<T>(t, i); });
+  if
+    constexpr(is_contiguous_input<J> && is_byte_output<I> &&
+              serial_size<T> == sizeof(T)) {
+      if (!count)
+        return;
+      auto bytes = reinterpret_cast<uint8_t *>(
+          contiguous_output<I>::claim(i, count * serial_size<T>));
+      memcpy(bytes, &*j, count * serial_size<T>);
+      if
+        constexpr(wire_swapped<T>) reverse_endian_n<T>(bytes, count);
+    }
+  else
+    for_each(j, j + count, [&i](const T &t) { serialize_number<T>(t, i); });
+}
+
+// Gathers the wire images of count fixed layout values, see layout_plan.
+template <typename T, typename I>
+void serialize_fixed(size_t count, const T *t, I &i) {
+  auto &plan = fixed_layout_plan<T>();
+  auto from = reinterpret_cast<const uint8_t *>(t);
+  auto end = from + count * sizeof(T);
+  if
+    constexpr(is_byte_output<I>) {
+      if (!count)
+        return;
+      auto bytes = reinterpret_cast<uint8_t *>(
+          contiguous_output<I>::claim(i, count * plan.size));
+      if (plan.dense)
+        memcpy(bytes, from, count * plan.size);
+      else
+        for (; from != end; from += sizeof(T))
+          bytes = plan.gather(from, bytes);
+    }
+  else
+    for (; from != end; from += sizeof(T))
+      for (auto &run : plan.runs)
+        i = copy_n(from + run.first, run.second, i);
 }
 
 template <typename T, typename I, typename J>
 void serialize_objects(uint32_t count, J j, I &i) {
-  for (auto end = count, c = 0u; c < end; ++c)
-    serializer<T>::serialize(*j++, i);
+  if
+    constexpr(layout<T>::fixed && is_contiguous_input<J>) {
+      if (count)
+        serialize_fixed(count, &*j, i);
+    }
+  else
+    for (auto end = count, c = 0u; c < end; ++c)
+      serializer<T>::serialize(*j++, i);
 }
 
 template <typename T, typename I, typename J>
@@ -100,34 +152,77 @@ void serialize_heterogenous(const T &t, index_sequence<Is...>, I &i) {
     (void)rc;
 }
 
+template <typename T> constexpr size_t serialized_size(const T &t) {
+  return serializer<T>::serialized_size(t);
+}
+
+// Sequence elements that are numbers go out raw, see serialize_numbers.
+template <typename T> constexpr size_t serialized_size_element(const T &t) {
+  if
+    constexpr(is_arithmetic_v<T>) return serial_size<T>;
+  else
+    return serializer<T>::serialized_size(t);
+}
+
+template <typename T, typename J>
+constexpr size_t serialized_size_objects(uint32_t count, J j) {
+  if
+    constexpr(is_arithmetic_v<T>) return count * serial_size<T>;
+  else if
+    constexpr(layout<T>::fixed) return count * fixed_layout_plan<T>().size;
+  else {
+    size_t size = 0;
+    for (auto end = count, c = 0u; c < end; ++c)
+      size += serialized_size_element<T>(*j++);
+    return size;
+  }
+}
+
+template <typename T, typename U, typename A>
+size_t serialized_size_associative(const A &a) {
+  return accumulate(cbegin(a), cend(a), serial_size<uint32_t>,
+                    [](size_t size, const pair<const T, U> &p) {
+                      return size + serialized_size_element<T>(p.first) +
+                             serialized_size_element<U>(p.second);
+                    });
+}
+
+template <typename T, size_t... Is>
+constexpr size_t serialized_size_heterogenous(const T &t,
+                                              index_sequence<Is...>) {
+  using std::get;
+  using n2w::get;
+  return (size_t{0} + ... + serialized_size(get<Is>(t)));
+}
+
 template <typename T> struct serializer {
+  static constexpr size_t serialized_size(const T &t) {
+    if
+      constexpr(is_void_v<T> || is_same_v<T, void *>) return 0;
+    else if
+      constexpr(is_same_v<T, char16_t> || is_same_v<T, wchar_t>) return serial_size<char32_t>;
+    else if
+      constexpr(is_enum_v<T>) return serial_size<underlying_type_t<T>>;
+    else if
+      constexpr(is_arithmetic_v<T>) return serial_size<T>;
+    else if
+      constexpr(is_heterogenous<T>) return serialized_size_heterogenous(
+          t, make_index_sequence<tuple_size_v<T>>{});
+    else if
+      constexpr(is_sequence<T>) return serial_size<uint32_t> +
+          serialized_size_objects<typename T::value_type>(t.size(), cbegin(t));
+    else if
+      constexpr(is_associative<T>) return serialized_size_associative<
+          typename T::key_type, typename T::mapped_type>(t);
+    else
+      return 0;
+  }
   template <typename I> static auto serialize(const T &t, I &i) {
     if
       constexpr(is_void_v<T> || is_same_v<T, void *>);
     else if
-      constexpr(is_same_v<T, char16_t>) {
-        u16string ts;
-        ts += t;
-        struct cvt16 : codecvt<char16_t, char, mbstate_t> {};
-        wstring_convert<cvt16, char16_t> cvter16;
-        auto cs = cvter16.to_bytes(ts);
-        struct cvt32 : codecvt<char32_t, char, mbstate_t> {};
-        wstring_convert<cvt32, char32_t> cvter32;
-        auto c32s = cvter32.from_bytes(cs);
-        serialize_number<char32_t>(c32s[0], i);
-      }
-    else if
-      constexpr(is_same_v<T, wchar_t>) {
-        wstring ts;
-        ts += t;
-        struct wcvt : codecvt<wchar_t, char, mbstate_t> {};
-        wstring_convert<wcvt, wchar_t> wcvter;
-        auto cs = wcvter.to_bytes(ts);
-        struct cvt32 : codecvt<char32_t, char, mbstate_t> {};
-        wstring_convert<cvt32, char32_t> cvter32;
-        auto c32s = cvter32.from_bytes(cs);
-        serialize_number<char32_t>(c32s[0], i);
-      }
+      constexpr(is_same_v<T, char16_t> || is_same_v<T, wchar_t>)
+          serialize_number<char32_t>(to_code_point(t), i);
     else if
       constexpr(is_enum_v<T>) serializer<underlying_type_t<T>>::serialize(
           static_cast<underlying_type_t<T>>(t), i);
@@ -146,34 +241,103 @@ template <typename T> struct serializer {
   }
 };
 template <typename T, size_t N> struct serializer<T[N]> {
+  static constexpr size_t serialized_size(const T (&t)[N]) {
+    return serialized_size_objects<T>(N, t);
+  }
   template <typename I> static void serialize(const T (&t)[N], I &i) {
     serialize_sequence_bounded<T>(N, t, i);
   }
 };
+template <typename T, size_t N> struct serializer<array<T, N>> {
+  static constexpr size_t serialized_size(const array<T, N> &t) {
+    return serialized_size_objects<T>(N, t.data());
+  }
+  template <typename I> static void serialize(const array<T, N> &t, I &i) {
+    serialize_sequence_bounded<T>(N, t.data(), i);
+  }
+};
 template <typename T, size_t M, size_t N> struct serializer<T[M][N]> {
+  static constexpr size_t serialized_size(const T (&t)[M][N]) {
+    return serializer<T[M * N]>::serialized_size(
+        reinterpret_cast<const T(&)[M * N]>(t));
+  }
   template <typename I> static void serialize(const T (&t)[M][N], I &i) {
     serializer<T[M * N]>::serialize(reinterpret_cast<const T(&)[M * N]>(t), i);
   }
 };
 template <typename T, typename... Traits>
 struct serializer<basic_string<T, Traits...>> {
+  static size_t serialized_size(const basic_string<T, Traits...> &t) {
+    return serial_size<uint32_t> + utf8_size(t.data(), t.size());
+  }
   template <typename I>
   static void serialize(const basic_string<T, Traits...> &t, I &i) {
-    string utf8;
+    auto size = utf8_size(t.data(), t.size());
+    serialize_number<uint32_t>(size, i);
+    serialize_utf8(t, size, i);
+  }
+  // Writes the size bytes of UTF-8 in t, without a count. Wide strings are
+  // transcoded straight into the output when it is a byte buffer, see
+  // native-2-web-transcode.hpp.
+  template <typename I>
+  static void serialize_utf8(const basic_string<T, Traits...> &t, size_t size,
+                             I &i) {
     if
-      constexpr(!is_same<T, char>{}) {
-        wstring_convert<codecvt_utf8<T>, T> cvter{
-            "Could not convert from " + mangled<basic_string<T, Traits...>>() +
-            " to " + mangled<basic_string<char, Traits...>>()};
-        utf8 = cvter.to_bytes(t);
+      constexpr(is_same<T, char>{})
+          serialize_numbers<char>(t.size(), cbegin(t), i);
+    else if
+      constexpr(is_byte_output<I>) {
+        if (size)
+          to_utf8(t.data(), t.size(), reinterpret_cast<uint8_t *>(
+                                          contiguous_output<I>::claim(i, size)));
       }
-    else
-      utf8 = t;
-    serialize_sequence<char>(utf8.size(), cbegin(utf8), i);
+    else {
+      string utf8(size, '\0');
+      to_utf8(t.data(), t.size(), reinterpret_cast<uint8_t *>(&utf8[0]));
+      i = copy(cbegin(utf8), cend(utf8), i);
+    }
+  }
+};
+template <typename T, typename... Traits>
+struct serializer<basic_string_view<T, Traits...>> {
+  static_assert(is_same<T, char>{}, "Only UTF-8 string views are supported");
+  static constexpr size_t
+  serialized_size(const basic_string_view<T, Traits...> &t) {
+    return serial_size<uint32_t> + t.size();
+  }
+  template <typename I>
+  static void serialize(const basic_string_view<T, Traits...> &t, I &i) {
+    serialize_sequence<char>(t.size(), cbegin(t), i);
+  }
+};
+// The wire counts a view's bytes in 32 bits, so larger views are refused
+// rather than cut short.
+template <typename T> struct serializer<numbers_view<T>> {
+  static size_t checked_bytes(const numbers_view<T> &t) {
+    if (t.size() > numeric_limits<uint32_t>::max() / serial_size<T>)
+      throw length_error{"numbers_view too large to serialize"};
+    return t.size() * serial_size<T>;
+  }
+  static size_t serialized_size(const numbers_view<T> &t) {
+    return serial_size<uint32_t> + checked_bytes(t);
+  }
+  template <typename I> static void serialize(const numbers_view<T> &t, I &i) {
+    checked_bytes(t);
+    serialize_number<uint32_t>(t.size(), i);
+    serialize_numbers<uint8_t>(t.size() * serial_size<T>, t.data(), i);
   }
 };
 template <typename S, typename T, typename... Ts, typename... Bs>
 struct serializer<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
+  static size_t
+  serialized_size(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &t) {
+    if
+      constexpr(layout<S>::fixed) return fixed_layout_plan<S>().size;
+    return (size_t{0} + ... +
+            serializer<Bs>::serialized_size(*static_cast<const Bs *>(t.s_read))) +
+           serialized_size_heterogenous(t,
+                                        make_index_sequence<sizeof...(Ts) + 1>{});
+  }
   template <typename B, typename I> static int serialize(const B &b, I &i) {
     serializer<B>::serialize(b, i);
     return 0;
@@ -181,13 +345,132 @@ struct serializer<structure<S, tuple<T, Ts...>, tuple<Bs...>>> {
   template <typename I>
   static void serialize(const structure<S, tuple<T, Ts...>, tuple<Bs...>> &t,
                         I &i) {
-    initializer_list<int> rc = {
-        serialize(*static_cast<const Bs *>(t.s_read), i)...};
-    (void)rc;
-    serialize_heterogenous(t, make_index_sequence<sizeof...(Ts) + 1>{}, i);
+    if
+      constexpr(layout<S>::fixed) serialize_fixed(1, t.s_read, i);
+    else {
+      initializer_list<int> rc = {
+          serialize(*static_cast<const Bs *>(t.s_read), i)...};
+      (void)rc;
+      serialize_heterogenous(t, make_index_sequence<sizeof...(Ts) + 1>{}, i);
+    }
+  }
+};
+// The number a field goes into its column as, see column_number.
+template <typename N, typename F> N column_value(const F &f) {
+  if
+    constexpr(is_same_v<F, char16_t> || is_same_v<F, wchar_t>) return
+        to_code_point(f);
+  else
+    return static_cast<N>(f);
+}
+
+// Column by column: numbers as one run each, strings as a run of uint32 end
+// offsets, starting with 0, followed by their UTF-8, and anything else as its
+// values back to back. Runs of numbers, offsets included, are padded as
+// column_padding asks. offset counts from the start of the columns.
+template <typename R> struct column_sizer {
+  const vector<R> &rows;
+  size_t offset;
+  template <typename F, typename P> void column(P project) {
+    if
+      constexpr(is_arithmetic_v<F> || is_enum_v<F>) {
+        using N = column_number_t<F>;
+        offset += column_padding<N>(offset) + rows.size() * serial_size<N>;
+      }
+    else if
+      constexpr(is_string_column<F>) {
+        offset += column_padding<uint32_t>(offset) +
+                  (rows.size() + 1) * serial_size<uint32_t>;
+        for (auto &r : rows)
+          offset += utf8_size(project(r).data(), project(r).size());
+      }
+    else if
+      constexpr(layout<F>::fixed) offset +=
+          rows.size() * fixed_layout_plan<F>().size;
+    else
+      for (auto &r : rows)
+        offset += serializer<F>::serialized_size(project(r));
+  }
+};
+
+template <typename R, typename I> struct column_writer {
+  const vector<R> &rows;
+  I &i;
+  size_t offset;
+  void pad(size_t padding) {
+    offset += padding;
+    for (; padding; --padding)
+      serialize_number<uint8_t>(0, i);
+  }
+  template <typename F, typename P> void column(P project) {
+    if
+      constexpr(is_arithmetic_v<F> || is_enum_v<F>) {
+        using N = column_number_t<F>;
+        pad(column_padding<N>(offset));
+        offset += rows.size() * serial_size<N>;
+        if
+          constexpr(is_byte_output<I>) {
+            if (rows.empty())
+              return;
+            auto bytes = reinterpret_cast<uint8_t *>(
+                contiguous_output<I>::claim(i, rows.size() * serial_size<N>));
+            for (auto &r : rows) {
+              auto n = column_value<N>(project(r));
+              if
+                constexpr(wire_swapped<N>) n = reverse_endian(n);
+              memcpy(bytes, &n, serial_size<N>);
+              bytes += serial_size<N>;
+            }
+          }
+        else
+          for (auto &r : rows)
+            serialize_number<N>(column_value<N>(project(r)), i);
+      }
+    else if
+      constexpr(is_string_column<F>) {
+        pad(column_padding<uint32_t>(offset));
+        vector<uint32_t> sizes;
+        sizes.reserve(rows.size());
+        uint32_t end = 0;
+        serialize_number<uint32_t>(end, i);
+        for (auto &r : rows) {
+          sizes.push_back(utf8_size(project(r).data(), project(r).size()));
+          serialize_number<uint32_t>(end += sizes.back(), i);
+        }
+        for (size_t k = 0; k < rows.size(); ++k)
+          serializer<F>::serialize_utf8(project(rows[k]), sizes[k], i);
+        offset += (rows.size() + 1) * serial_size<uint32_t> + end;
+      }
+    else if
+      constexpr(layout<F>::fixed) {
+        for (auto &r : rows)
+          serialize_fixed(1, &project(r), i);
+        offset += rows.size() * fixed_layout_plan<F>().size;
+      }
+    else
+      for (auto &r : rows) {
+        serializer<F>::serialize(project(r), i);
+        offset += serializer<F>::serialized_size(project(r));
+      }
+  }
+};
+
+template <typename T> struct serializer<columns<T>> {
+  static size_t serialized_size(const columns<T> &t) {
+    column_sizer<T> sizer{t, serial_size<uint32_t>};
+    for_each_column<T>([](auto &r) -> auto & { return r; }, sizer);
+    return sizer.offset;
+  }
+  template <typename I> static void serialize(const columns<T> &t, I &i) {
+    serialize_number<uint32_t>(t.size(), i);
+    column_writer<T, I> writer{t, i, serial_size<uint32_t>};
+    for_each_column<T>([](auto &r) -> auto & { return r; }, writer);
   }
 };
 template <typename T> struct serializer<optional<T>> {
+  static constexpr size_t serialized_size(const optional<T> &o) {
+    return serial_size<bool> + (o ? serializer<T>::serialized_size(*o) : 0);
+  }
   template <typename I> static void serialize(const optional<T> &o, I &i) {
     serializer<bool>::serialize(static_cast<bool>(o), i);
     if (o)
@@ -195,6 +478,15 @@ template <typename T> struct serializer<optional<T>> {
   }
 };
 template <typename... Ts> struct serializer<variant<Ts...>> {
+  static constexpr size_t serialized_size(const variant<Ts...> &v) {
+    return serial_size<uint32_t> +
+           visit(
+               [](const auto &t) {
+                 return serializer<remove_cv_t<
+                     remove_reference_t<decltype(t)>>>::serialized_size(t);
+               },
+               v);
+  }
   template <typename I> static void serialize(const variant<Ts...> &v, I &i) {
     serializer<uint32_t>::serialize(v.index(), i);
     visit(
@@ -207,33 +499,52 @@ template <typename... Ts> struct serializer<variant<Ts...>> {
 };
 template <typename R, intmax_t N, intmax_t D>
 struct serializer<chrono::duration<R, ratio<N, D>>> {
+  static constexpr size_t
+  serialized_size(const chrono::duration<R, ratio<N, D>> &) {
+    return serial_size<double>;
+  }
   template <typename I>
   static void serialize(const chrono::duration<R, ratio<N, D>> &t, I &i) {
     serializer<double>::serialize(t.count(), i);
   }
 };
 template <typename C, typename D> struct serializer<chrono::time_point<C, D>> {
+  static constexpr size_t serialized_size(const chrono::time_point<C, D> &t) {
+    return serializer<D>::serialized_size(t.time_since_epoch());
+  }
   template <typename I>
   static void serialize(const chrono::time_point<C, D> &t, I &i) {
     serializer<D>::serialize(t.time_since_epoch(), i);
   }
 };
 template <typename T> struct serializer<complex<T>> {
+  static constexpr size_t serialized_size(const complex<T> &) {
+    return 2 * serial_size<T>;
+  }
   template <typename I> static void serialize(const complex<T> &c, I &i) {
     serializer<pair<T, T>>::serialize(make_pair(c.real(), c.imag()), i);
   }
 };
 template <typename T> struct serializer<atomic<T>> {
+  static size_t serialized_size(const atomic<T> &a) {
+    return serializer<T>::serialized_size(a);
+  }
   template <typename I> static void serialize(const atomic<T> &a, I &i) {
     serializer<T>::serialize(a, i);
   }
 };
 template <size_t N> struct serializer<bitset<N>> {
+  static constexpr size_t serialized_size(const bitset<N> &) {
+    return serial_size<uint32_t> + N;
+  }
   template <typename I> static void serialize(const bitset<N> &b, I &i) {
     serializer<string>::serialize(b.to_string(), i);
   }
 };
 template <> struct serializer<filesystem::space_info> {
+  static constexpr size_t serialized_size(const filesystem::space_info &) {
+    return 3 * serial_size<double>;
+  }
   template <typename I>
   static void serialize(const filesystem::space_info &s, I &i) {
     serializer<tuple<double, double, double>>::serialize(
@@ -241,6 +552,10 @@ template <> struct serializer<filesystem::space_info> {
   }
 };
 template <> struct serializer<filesystem::file_status> {
+  static constexpr size_t serialized_size(const filesystem::file_status &) {
+    return serial_size<underlying_type_t<filesystem::file_type>> +
+           serial_size<underlying_type_t<filesystem::perms>>;
+  }
   template <typename I>
   static void serialize(const filesystem::file_status &f, I &i) {
     serializer<pair<filesystem::file_type, filesystem::perms>>::serialize(
@@ -248,6 +563,13 @@ template <> struct serializer<filesystem::file_status> {
   }
 };
 template <> struct serializer<filesystem::path> {
+  static size_t serialized_size(const filesystem::path &p) {
+    return accumulate(cbegin(p), cend(p), serial_size<uint32_t>,
+                      [](size_t size, const filesystem::path &segment) {
+                        return size + serial_size<uint32_t> +
+                               segment.generic_u8string().size();
+                      });
+  }
   template <typename I> static void serialize(const filesystem::path &p, I &i) {
     vector<string> segments;
     transform(cbegin(p), cend(p), back_inserter(segments),
@@ -256,6 +578,12 @@ template <> struct serializer<filesystem::path> {
   }
 };
 template <> struct serializer<filesystem::directory_entry> {
+  static size_t serialized_size(const filesystem::directory_entry &d) {
+    return serializer<filesystem::path>::serialized_size(d.path()) +
+           serial_size<bool> + 2 * serial_size<uint32_t> +
+           serial_size<double> +
+           serializer<filesystem::file_status>::serialized_size({});
+  }
   template <typename I>
   static void serialize(const filesystem::directory_entry &d, I &i) {
     error_code ec;
@@ -281,11 +609,16 @@ template <> struct serializer<filesystem::directory_entry> {
 }
 
 using serialize_detail::serialize;
+using serialize_detail::serialized_size;
 using serialize_detail::serializer;
 
 #define N2W__SERIALIZE_SPEC(s, m, ...)                                         \
   namespace n2w {                                                              \
   template <> struct serializer<s> {                                           \
+    static size_t serialized_size(const s &_s) {                               \
+      N2W__CONSTRUCTOR(s, m, _s, __VA_ARGS__);                                 \
+      return serializer<decltype(_s_v)>::serialized_size(_s_v);               \
+    }                                                                          \
     template <typename I> static void serialize(const s &_s, I &i) {           \
       N2W__CONSTRUCTOR(s, m, _s, __VA_ARGS__);                                 \
       serializer<decltype(_s_v)>::serialize(_s_v, i);                          \
@@ -296,6 +629,9 @@ using serialize_detail::serializer;
 #define N2W__SERIALIZE_FROM(s, c)                                              \
   namespace n2w {                                                              \
   template <> struct serializer<s> {                                           \
+    static size_t serialized_size(const s &_s) {                               \
+      return serializer<decltype(c(_s))>::serialized_size(c(_s));              \
+    }                                                                          \
     template <typename I> static void serialize(const s &_s, I &i) {           \
       serializer<decltype(c(_s))>::serialize(c(_s), i);                        \
     }                                                                          \
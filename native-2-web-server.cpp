@@ -1,10 +1,19 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <experimental/filesystem>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <mutex>
 #include <regex>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/steady_timer.hpp>
@@ -75,18 +84,45 @@ struct server_options {
   optional<unsigned> accept_threads = 0;
   optional<unsigned> connect_threads = 0;
   optional<unsigned> worker_sessions = 0;
+  optional<unsigned> processes = 0;
   optional<string> multicast_address = "233.252.18.0";
   optional<unsigned short> multicast_port = 9002;
+  optional<unsigned> stack_pool_cap = 64;
+  optional<unsigned> connection_pool_cap = 1024;
+  optional<bool> prefault_stacks = false;
+  optional<unsigned> max_in_flight = 256;
+  optional<unsigned> max_outbound_bytes = 16 << 20;
+  optional<unsigned> stream_window = 4 << 20;
+  optional<unsigned> max_batch = 64;
+  optional<unsigned> max_batch_delay = 0;
+  optional<unsigned> fragment_bytes = 64 << 10;
+  optional<unsigned> urgent_bytes = 4 << 10;
+  optional<unsigned> handshake_timeout = 10;
+  optional<unsigned> idle_timeout = 60;
+  optional<unsigned> read_timeout = 30;
+  optional<unsigned> write_timeout = 30;
 };
 
 N2W__BINARY_SPEC(server_options,
                  N2W__MEMBERS(address, port, port_range, worker_threads,
                               accept_threads, connect_threads, worker_sessions,
-                              multicast_address, multicast_port));
+                              processes, multicast_address, multicast_port,
+                              stack_pool_cap, connection_pool_cap,
+                              prefault_stacks, max_in_flight,
+                              max_outbound_bytes, stream_window, max_batch,
+                              max_batch_delay,
+                              fragment_bytes, urgent_bytes, handshake_timeout,
+                              idle_timeout, read_timeout, write_timeout));
 N2W__JS_SPEC(server_options,
              N2W__MEMBERS(address, port, port_range, worker_threads,
                           accept_threads, connect_threads, worker_sessions,
-                          multicast_address, multicast_port));
+                          processes, multicast_address, multicast_port,
+                          stack_pool_cap, connection_pool_cap, prefault_stacks,
+                          max_in_flight, max_outbound_bytes, stream_window,
+                          max_batch,
+                          max_batch_delay, fragment_bytes, urgent_bytes,
+                          handshake_timeout, idle_timeout, read_timeout,
+                          write_timeout));
 
 // Servers can redirect to other servers
 // Load balancing
@@ -99,6 +135,18 @@ struct server_statistics {
   atomic_bool spawned = false;
   atomic<rep> startup = 0, shutdown = 0;
   atomic_int32_t threads = 0, tasks = 0, connections = 0, upgrades = 0;
+  // Coroutine stacks reused, newly mapped and mapped at most at once.
+  atomic_uint32_t stack_hits = 0, stack_misses = 0, stack_high_water = 0;
+  // Times websockets stopped reading at their flow limits, and websockets
+  // stopped now.
+  atomic_uint32_t read_pauses = 0, paused_connections = 0;
+  // Connections shut down for taking too long over each step.
+  atomic_uint32_t handshake_timeouts = 0, idle_timeouts = 0, read_timeouts = 0,
+                  write_timeouts = 0;
+  // KiB held for connections in objects, read buffers, queued replies,
+  // streamed arguments and coroutine stacks.
+  atomic_uint32_t object_kib = 0, read_buffer_kib = 0, queued_reply_kib = 0,
+                  streamed_kib = 0, stack_kib = 0;
   array<rep, ring_size> accept = {0}, connect = {0}, upgrade = {0}, close = {0};
   array<boost::system::error_code, ring_size> error = {
       make_error_code(boost::system::errc::success)};
@@ -118,6 +166,20 @@ struct server_statistics {
     tasks = other.tasks.load();
     connections = other.connections.load();
     upgrades = other.upgrades.load();
+    stack_hits = other.stack_hits.load();
+    stack_misses = other.stack_misses.load();
+    stack_high_water = other.stack_high_water.load();
+    read_pauses = other.read_pauses.load();
+    paused_connections = other.paused_connections.load();
+    handshake_timeouts = other.handshake_timeouts.load();
+    idle_timeouts = other.idle_timeouts.load();
+    read_timeouts = other.read_timeouts.load();
+    write_timeouts = other.write_timeouts.load();
+    object_kib = other.object_kib.load();
+    read_buffer_kib = other.read_buffer_kib.load();
+    queued_reply_kib = other.queued_reply_kib.load();
+    streamed_kib = other.streamed_kib.load();
+    stack_kib = other.stack_kib.load();
     accept_head = other.accept_head.load();
     connect_head = other.connect_head.load();
     upgrade_head = other.upgrade_head.load();
@@ -147,6 +209,43 @@ struct server_statistics {
   void on_task_start() { ++tasks; }
   void on_task_end() { --tasks; }
 
+  void on_stack_pool() {
+    stack_hits = n2w::stack_pool::hits;
+    stack_misses = n2w::stack_pool::misses;
+    stack_high_water = n2w::stack_pool::high_water;
+  }
+
+  void on_connection_memory() {
+    object_kib = n2w::connection_memory::objects >> 10;
+    read_buffer_kib = n2w::connection_memory::read_buffers >> 10;
+    queued_reply_kib = n2w::connection_memory::queued_replies >> 10;
+    streamed_kib = n2w::connection_memory::streamed_arguments >> 10;
+    stack_kib = n2w::stack_pool::mapped_bytes >> 10;
+  }
+
+  void on_pause() {
+    ++read_pauses;
+    ++paused_connections;
+  }
+  void on_resume() { --paused_connections; }
+
+  void on_timeout(n2w::timeout_kind kind) {
+    switch (kind) {
+    case n2w::timeout_kind::handshake:
+      ++handshake_timeouts;
+      break;
+    case n2w::timeout_kind::idle:
+      ++idle_timeouts;
+      break;
+    case n2w::timeout_kind::read:
+      ++read_timeouts;
+      break;
+    case n2w::timeout_kind::write:
+      ++write_timeouts;
+      break;
+    }
+  }
+
   void on_accept(time_point t) {
     ++connections;
     on_time_array(accept, accept_head, t.time_since_epoch().count());
@@ -169,6 +268,29 @@ struct server_statistics {
   void on_error(boost::system::error_code &ec) {
     error[error_head++ % ring_size] = ec;
   }
+
+  // Adds the counts of another process serving the same port.
+  server_statistics &operator+=(const server_statistics &other) {
+    threads += other.threads;
+    tasks += other.tasks;
+    connections += other.connections;
+    upgrades += other.upgrades;
+    stack_hits += other.stack_hits;
+    stack_misses += other.stack_misses;
+    stack_high_water += other.stack_high_water;
+    read_pauses += other.read_pauses;
+    paused_connections += other.paused_connections;
+    handshake_timeouts += other.handshake_timeouts;
+    idle_timeouts += other.idle_timeouts;
+    read_timeouts += other.read_timeouts;
+    write_timeouts += other.write_timeouts;
+    object_kib += other.object_kib;
+    read_buffer_kib += other.read_buffer_kib;
+    queued_reply_kib += other.queued_reply_kib;
+    streamed_kib += other.streamed_kib;
+    stack_kib += other.stack_kib;
+    return *this;
+  }
 };
 
 ostream &operator<<(ostream &out, const server_statistics &stats) {
@@ -199,12 +321,168 @@ ostream &operator<<(ostream &out, const server_statistics &stats) {
 
 N2W__BINARY_SPEC(server_statistics,
                  N2W__MEMBERS(startup, threads, tasks, connections, upgrades,
+                              stack_hits, stack_misses, stack_high_water,
+                              read_pauses, paused_connections,
+                              handshake_timeouts, idle_timeouts, read_timeouts,
+                              write_timeouts, object_kib, read_buffer_kib,
+                              queued_reply_kib, streamed_kib, stack_kib,
                               accept, connect, upgrade, close, webroot,
                               current_directory, user, modules));
 N2W__JS_SPEC(server_statistics,
              N2W__MEMBERS(startup, threads, tasks, connections, upgrades,
-                          accept, connect, upgrade, close, webroot,
-                          current_directory, user, modules));
+                          stack_hits, stack_misses, stack_high_water,
+                          read_pauses, paused_connections, handshake_timeouts,
+                          idle_timeouts, read_timeouts, write_timeouts,
+                          object_kib, read_buffer_kib, queued_reply_kib,
+                          streamed_kib, stack_kib, accept, connect, upgrade,
+                          close, webroot, current_directory, user, modules));
+
+// FNV-1a of a service pointer, so that clients can tell services apart
+// without the pointer itself.
+uint32_t pointer_hash(const string &pointer) {
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : pointer)
+    hash = (hash ^ c) * 16777619u;
+  return hash;
+}
+
+// Runs child servers from the executable of this one, in the directory the
+// supervisor was made in, and starts a child again when it dies of anything
+// but a request to stop. A child that died within a second of starting, or
+// that could not be forked, waits a second before it is started again.
+class supervisor {
+  struct child {
+    vector<string> arguments;
+    vector<int> inherited;
+    pid_t pid = 0;
+    chrono::steady_clock::time_point started;
+  };
+
+  boost::asio::io_service &service;
+  boost::asio::signal_set exits;
+  const string directory = filesystem::current_path().u8string();
+  mutex guard;
+  list<child> children;
+  bool stopping = false;
+
+  // Closes every descriptor but the inherited ones in the child, between
+  // fork and exec where only async-signal-safe calls may be made.
+  void start(list<child>::iterator c) {
+    vector<char *> argv;
+    for (auto &argument : c->arguments)
+      argv.push_back(const_cast<char *>(argument.c_str()));
+    argv.push_back(nullptr);
+    vector<int> open;
+    for (auto &entry : filesystem::directory_iterator{"/proc/self/fd"})
+      open.push_back(stoi(entry.path().filename().string()));
+    c->started = chrono::steady_clock::now();
+    auto pid = fork();
+    if (pid < 0) {
+      clog << "Cannot start child: " << strerror(errno) << '\n';
+      retry(c);
+      return;
+    }
+    if (pid) {
+      c->pid = pid;
+      return;
+    }
+    auto &inherited = c->inherited;
+    for (auto fd : open)
+      if (fd > 2 &&
+          find(cbegin(inherited), cend(inherited), fd) == cend(inherited))
+        close(fd);
+    for (auto fd : inherited)
+      fcntl(fd, F_SETFD, 0);
+    if (chdir(directory.c_str()))
+      _exit(127);
+    execv("/proc/self/exe", argv.data());
+    _exit(127);
+  }
+
+  static bool stopped(int status) {
+    if (WIFSIGNALED(status))
+      return WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGINT;
+    return WEXITSTATUS(status) == 0;
+  }
+
+  void restart(list<child>::iterator c) {
+    if (chrono::steady_clock::now() - c->started >= chrono::seconds{1}) {
+      start(c);
+      return;
+    }
+    retry(c);
+  }
+
+  // Starts the child again in a second. Until then it has no pid.
+  void retry(list<child>::iterator c) {
+    c->pid = 0;
+    auto timer = make_shared<boost::asio::steady_timer>(service);
+    timer->expires_from_now(chrono::seconds{1});
+    timer->async_wait([ this, c, timer ](const auto &ec) {
+      lock_guard<mutex> lock{guard};
+      if (!stopping)
+        start(c);
+      else
+        children.erase(c);
+    });
+  }
+
+  void reap() {
+    lock_guard<mutex> lock{guard};
+    for (auto c = begin(children); c != end(children);) {
+      int status = 0;
+      if (!c->pid || waitpid(c->pid, &status, WNOHANG) != c->pid) {
+        ++c;
+        continue;
+      }
+      clog << "Child " << c->pid << " exited with status " << status << '\n';
+      if (on_exit)
+        on_exit(c->pid);
+      if (stopping || stopped(status)) {
+        c = children.erase(c);
+        continue;
+      }
+      restart(c++);
+    }
+  }
+
+  void wait() {
+    exits.async_wait([this](const auto &ec, int) {
+      if (ec)
+        return;
+      reap();
+      wait();
+    });
+  }
+
+public:
+  // Called with the pid of every child that exits, restarted or not.
+  function<void(pid_t)> on_exit;
+
+  explicit supervisor(boost::asio::io_service &service)
+      : service{service}, exits{service, SIGCHLD} {
+    wait();
+  }
+
+  // Starts a child with the given command line, handing it the inherited
+  // descriptors. Returns its pid, or 0 when it could not be forked and will
+  // be tried again.
+  pid_t launch(vector<string> arguments, vector<int> inherited = {}) {
+    lock_guard<mutex> lock{guard};
+    children.push_back({move(arguments), move(inherited)});
+    start(prev(end(children)));
+    return children.back().pid;
+  }
+
+  // Asks every child to stop and starts none again.
+  void terminate() {
+    lock_guard<mutex> lock{guard};
+    stopping = true;
+    for (auto &c : children)
+      if (c.pid)
+        kill(c.pid, SIGTERM);
+  }
+};
 
 int main(int c, char **v) {
   using namespace boost::asio;
@@ -212,12 +490,57 @@ int main(int c, char **v) {
   using namespace n2w;
 
   static const filesystem::path web_root = filesystem::current_path();
-  static map<vector<string>, n2w::plugin> plugins;
+  using plugin_set = map<vector<string>, n2w::plugin>;
+  static shared_ptr<const plugin_set> plugins = make_shared<plugin_set>();
+  static n2w::plugin server;
+  static io_service service;
+  // Set in the processes of a prefork master, which serve its page port.
+  static bool prefork_worker = false;
+
+  // Calls name their service by id, an index into the entries of dispatch.
+  // An id is handed out once per pointer and survives plugin reloads, so
+  // pages loaded before a reload keep reaching the same services, or none.
+  // A reload publishes a new table rather than changing the one calls are
+  // reading, and a table keeps the plugins it points into loaded, so calls
+  // hold on to the table they started with until they finish.
+  struct dispatch_entry {
+    const n2w::plugin::function_type *function = nullptr;
+    n2w::placement where = n2w::placement::io;
+    const n2w::plugin::stream_function_type *stream = nullptr;
+    string pointer;
+  };
+  struct dispatch_table {
+    shared_ptr<const plugin_set> plugins;
+    vector<dispatch_entry> entries;
+  };
+  static shared_ptr<const dispatch_table> dispatch =
+      make_shared<dispatch_table>();
+  // Reloads take turns, and only they touch plugins and service_ids.
+  static mutex reload_mutex;
+  static unordered_map<string, uint32_t> service_ids;
+  static auto publish_dispatch = []() {
+    auto table = make_shared<dispatch_table>();
+    table->plugins = plugins;
+    auto assign_ids = [&table](const n2w::plugin &p) {
+      for (auto &s : p.get_services()) {
+        auto id = service_ids.emplace(s, service_ids.size()).first->second;
+        if (id >= table->entries.size())
+          table->entries.resize(id + 1);
+        table->entries[id] = {&p.get_function(s).get(), p.get_placement(s),
+                              p.get_stream_function(s), s};
+      }
+    };
+    assign_ids(server);
+    for (auto &p : *plugins)
+      assign_ids(p.second);
+    atomic_store(&dispatch, shared_ptr<const dispatch_table>{move(table)});
+  };
 
-  static auto reload_plugins = []() {
+  // Called with reload_mutex held.
+  static auto load_plugins = []() {
     clog << "Reloading plugins\n";
     const regex lib_rx{"libn2w-.+"};
-    plugins.clear();
+    auto loaded = make_shared<plugin_set>();
     filesystem::recursive_directory_iterator it{
         web_root, filesystem::directory_options::skip_permission_denied};
     for (const auto &entry : it) {
@@ -243,63 +566,105 @@ int main(int c, char **v) {
           begin(hierarchy), [offset = strlen("libn2w-")](const auto &module) {
             return module.substr(offset);
           });
-      plugins.emplace(hierarchy, modfile.c_str());
+      loaded->emplace(hierarchy, modfile.c_str());
     }
+    plugins = move(loaded);
+    publish_dispatch();
     clog << "Plugins reloaded\n";
   };
 
+  static auto reload_plugins = []() {
+    lock_guard<mutex> lock{reload_mutex};
+    load_plugins();
+  };
+
+  static supervisor spawned_servers{service};
   static auto spawn_server = [](optional<server_options> options) {
     clog << "Spawn server\n";
     server_options default_options;
-    return system(
-        ("(cd " + web_root.u8string() +
-         " && ./n2w-server --spawned --address " +
-         options->address.value_or(*default_options.address) + " --port " +
-         to_string(options->port.value_or(*default_options.port)) +
-         " --port-range " +
-         to_string(options->port_range.value_or(*default_options.port_range)) +
-         " --worker-threads " +
-         to_string(options->worker_threads.value_or(
-             *default_options.worker_threads)) +
-         " --accept-threads " +
-         to_string(options->accept_threads.value_or(
-             *default_options.accept_threads)) +
-         " --connect-threads " +
-         to_string(options->connect_threads.value_or(
-             *default_options.connect_threads)) +
-         " --worker-sessions " +
-         to_string(options->worker_sessions.value_or(
-             *default_options.worker_sessions)) +
-         " --multicast-address " +
-         options->multicast_address.value_or(
-             *default_options.multicast_address) +
-         " --multicast-port " +
-         to_string(options->multicast_port.value_or(
-             *default_options.multicast_port)) +
-         " &)&")
-            .c_str());
+    auto option = [&options, &default_options](auto member) {
+      return to_string(
+          ((*options).*member).value_or(*(default_options.*member)));
+    };
+    vector<string> arguments{
+        "n2w-server",
+        "--spawned",
+        "--address",
+        options->address.value_or(*default_options.address),
+        "--port",
+        option(&server_options::port),
+        "--port-range",
+        option(&server_options::port_range),
+        "--worker-threads",
+        option(&server_options::worker_threads),
+        "--accept-threads",
+        option(&server_options::accept_threads),
+        "--connect-threads",
+        option(&server_options::connect_threads),
+        "--worker-sessions",
+        option(&server_options::worker_sessions),
+        "--processes",
+        option(&server_options::processes),
+        "--multicast-address",
+        options->multicast_address.value_or(
+            *default_options.multicast_address),
+        "--multicast-port",
+        option(&server_options::multicast_port),
+        "--stack-pool-cap",
+        option(&server_options::stack_pool_cap),
+        "--connection-pool-cap",
+        option(&server_options::connection_pool_cap),
+        "--max-in-flight",
+        option(&server_options::max_in_flight),
+        "--max-outbound-bytes",
+        option(&server_options::max_outbound_bytes),
+        "--stream-window",
+        option(&server_options::stream_window),
+        "--max-batch",
+        option(&server_options::max_batch),
+        "--max-batch-delay",
+        option(&server_options::max_batch_delay),
+        "--fragment-bytes",
+        option(&server_options::fragment_bytes),
+        "--urgent-bytes",
+        option(&server_options::urgent_bytes),
+        "--handshake-timeout",
+        option(&server_options::handshake_timeout),
+        "--idle-timeout",
+        option(&server_options::idle_timeout),
+        "--read-timeout",
+        option(&server_options::read_timeout),
+        "--write-timeout",
+        option(&server_options::write_timeout)};
+    if (options->prefault_stacks.value_or(*default_options.prefault_stacks))
+      arguments.push_back("--prefault-stacks");
+    return spawned_servers.launch(move(arguments));
   };
 
-  static n2w::plugin server;
   server.register_service(N2W__DECLARE_API(reload_plugins), "");
   server.register_service("spawn_server_default_options",
-                          []() { return server_options{}; }, "");
+                          []() { return server_options{}; }, "",
+                          n2w::placement::inline_call);
   server.register_service(N2W__DECLARE_API(spawn_server), "");
-  server.register_service("stop_server", []() { raise(SIGTERM); }, "");
+  server.register_service(
+      "stop_server",
+      []() { kill(prefork_worker ? getppid() : getpid(), SIGTERM); }, "");
+  publish_dispatch();
 
   static auto create_modules = []() {
     clog << "Creating modules\n";
-    reload_plugins();
+    lock_guard<mutex> lock{reload_mutex};
+    load_plugins();
     string modules = "var n2w = (function () {\nlet n2w = {};\n";
     modules += "n2w['$server'] = {};\n";
     for (auto &s : server.get_services()) {
       modules += "n2w.$server." + server.get_name(s) + " = " +
-                 server.get_javascript(s) + ";\n";
+                 server.get_javascript(s, service_ids[s]) + ";\n";
       modules += "n2w.$server." + server.get_name(s) +
                  ".html = " + server.get_generator(s) + ";\n";
     }
 
-    for (auto &p : plugins) {
+    for (auto &p : *plugins) {
       string module;
       for (auto first = cbegin(p.first), last = min(first + 1, cend(p.first));
            last != cend(p.first); ++last) {
@@ -316,7 +681,7 @@ int main(int c, char **v) {
 
       for (auto &s : p.second.get_services()) {
         modules += "n2w" + module + '.' + p.second.get_name(s) + " = " +
-                   p.second.get_javascript(s) + ";\n";
+                   p.second.get_javascript(s, service_ids[s]) + ";\n";
         modules += "n2w" + module + '.' + p.second.get_name(s) +
                    ".html = " + p.second.get_generator(s) + ";\n";
       }
@@ -347,7 +712,9 @@ int main(int c, char **v) {
       "Number of threads for processing requests.\n'0' for automatic.\n")(
       "accept-threads",
       value<unsigned>()->default_value(*default_options.accept_threads),
-      "Number of threads for listening for connections.\n'0' for automatic.\n")(
+      "Number of threads serving the page port, each with an io_service of "
+      "its own pinned to a cpu and a listener sharing the port.\n'0' to "
+      "serve it from the threads shared with the other ports.\n")(
       "connect-threads",
       value<unsigned>()->default_value(*default_options.connect_threads),
       "Number of threads for connecting to servers.\n'0' for automatic.\n")(
@@ -355,6 +722,17 @@ int main(int c, char **v) {
       value<unsigned>()->default_value(*default_options.worker_sessions),
       "Number of worker servers to to handle long running tasks. If "
       "unspecified or '0', do not use workers.\n")(
+      "processes",
+      value<unsigned>()->default_value(*default_options.processes),
+      "Number of processes serving the page port, forked and restarted by "
+      "this one, which keeps the port and the other ones.\n'0' to serve "
+      "it from this process.\n")(
+      "listener-fd",
+      value<int>()->default_value(-1),
+      "Listening socket inherited from a prefork master.\n")(
+      "stats-fd",
+      value<int>()->default_value(-1),
+      "Socket to report statistics to a prefork master on.\n")(
       "multicast-address",
       value<string>()->default_value(*default_options.multicast_address),
       "IPv4 or IPv6 multicast group address for server to manage child "
@@ -362,7 +740,62 @@ int main(int c, char **v) {
       "multicast-port",
       value<unsigned short>()->default_value(*default_options.port + 1),
       "IPv4 or IPv6 multicast group address for server to manage "
-      "child processes.");
+      "child processes.")(
+      "stack-pool-cap",
+      value<unsigned>()->default_value(*default_options.stack_pool_cap),
+      "Number of coroutine stacks of each size every thread keeps for "
+      "reuse.\n")(
+      "connection-pool-cap",
+      value<unsigned>()->default_value(*default_options.connection_pool_cap),
+      "Number of freed connection objects of each size every thread keeps "
+      "for reuse.\n")(
+      "prefault-stacks",
+      value<bool>()->zero_tokens()->default_value(false)->implicit_value(true),
+      "Populate coroutine stacks when they are mapped.\n")(
+      "max-in-flight",
+      value<unsigned>()->default_value(*default_options.max_in_flight),
+      "Number of calls a websocket may have running before it stops reading "
+      "until one finishes.\n'0' for no limit.\n")(
+      "max-outbound-bytes",
+      value<unsigned>()->default_value(*default_options.max_outbound_bytes),
+      "Number of reply bytes a connection may have queued before its "
+      "websocket stops reading until some are written.\n'0' for no "
+      "limit.\n")(
+      "stream-window",
+      value<unsigned>()->default_value(*default_options.stream_window),
+      "Number of bytes of streamed arguments a connection may have received "
+      "and not read before its websocket stops reading.\n'0' for no "
+      "limit.\n")(
+      "max-batch",
+      value<unsigned>()->default_value(*default_options.max_batch),
+      "Number of websocket frames ready together to send with one write.\n")(
+      "max-batch-delay",
+      value<unsigned>()->default_value(*default_options.max_batch_delay),
+      "Microseconds to wait for more frames to join a batch that is not "
+      "full.\n")(
+      "fragment-bytes",
+      value<unsigned>()->default_value(*default_options.fragment_bytes),
+      "Size of the pieces websocket replies larger than it are sent in, taking "
+      "turns with smaller replies.\n'0' to send every reply whole.\n")(
+      "urgent-bytes",
+      value<unsigned>()->default_value(*default_options.urgent_bytes),
+      "Size up to which a websocket reply is sent ahead of the ones queued "
+      "before it.\n'0' to keep replies in the order they finish.\n")(
+      "handshake-timeout",
+      value<unsigned>()->default_value(*default_options.handshake_timeout),
+      "Seconds a new connection has to send its first request and, for a "
+      "websocket, be upgraded.\n'0' for no limit.\n")(
+      "idle-timeout",
+      value<unsigned>()->default_value(*default_options.idle_timeout),
+      "Seconds a connection with no calls running may wait before its next "
+      "request or websocket message.\n'0' for no limit.\n")(
+      "read-timeout",
+      value<unsigned>()->default_value(*default_options.read_timeout),
+      "Seconds a connection has to send the rest of a request it started, "
+      "and an idle websocket to answer its close.\n'0' for no limit.\n")(
+      "write-timeout",
+      value<unsigned>()->default_value(*default_options.write_timeout),
+      "Seconds a write to a connection may take.\n'0' for no limit.\n");
 
   static variables_map arguments;
   store(parse_command_line(c, v, options), arguments);
@@ -373,12 +806,108 @@ int main(int c, char **v) {
     return 0;
   }
 
-  static io_service service;
+  stack_pool::cap = arguments["stack-pool-cap"].as<unsigned>();
+  connection_pool::cap = arguments["connection-pool-cap"].as<unsigned>();
+  stack_pool::prefault = arguments["prefault-stacks"].as<bool>();
+  flow_limits::max_in_flight = arguments["max-in-flight"].as<unsigned>();
+  flow_limits::max_outbound_bytes =
+      arguments["max-outbound-bytes"].as<unsigned>();
+  flow_limits::max_streamed_bytes = arguments["stream-window"].as<unsigned>();
+  write_batching::max_frames = arguments["max-batch"].as<unsigned>();
+  write_batching::max_delay =
+      chrono::microseconds{arguments["max-batch-delay"].as<unsigned>()};
+  reply_fragmenting::fragment_bytes =
+      arguments["fragment-bytes"].as<unsigned>();
+  reply_fragmenting::urgent_bytes = arguments["urgent-bytes"].as<unsigned>();
+  connection_timeouts::handshake =
+      chrono::seconds{arguments["handshake-timeout"].as<unsigned>()};
+  connection_timeouts::idle =
+      chrono::seconds{arguments["idle-timeout"].as<unsigned>()};
+  connection_timeouts::read =
+      chrono::seconds{arguments["read-timeout"].as<unsigned>()};
+  connection_timeouts::write =
+      chrono::seconds{arguments["write-timeout"].as<unsigned>()};
+
+  // Services placed on workers run here, so they do not hold up the io
+  // threads.
+  static worker_pool workers{[]() {
+    auto n = arguments["worker-threads"].as<unsigned>();
+    if (!n)
+      n = thread::hardware_concurrency();
+    return n ? n : 5;
+  }()};
+
   io_service::work work{service};
   boost::system::error_code ec;
 
+  // A prefork master binds the page port, within the port range, and hands
+  // the listener to its workers, which serve it with the rest of this
+  // server. The workers report their statistics to the master on a datagram
+  // socket, and the master sums them up in its beacon.
+  prefork_worker = arguments["listener-fd"].as<int>() >= 0;
+  static const bool prefork_master =
+      !prefork_worker && arguments["processes"].as<unsigned>();
+  static unsigned short port = arguments["port"].as<unsigned short>();
+  static local::datagram_protocol::socket worker_reports{service};
+  static mutex worker_stats_mutex;
+  static map<pid_t, server_statistics> worker_stats;
+  static supervisor prefork{service};
+  if (prefork_worker)
+    worker_reports.assign(local::datagram_protocol{},
+                          arguments["stats-fd"].as<int>());
+  if (prefork_master) {
+    ip::tcp::endpoint endpoint{
+        ip::address::from_string(arguments["address"].as<string>()), port};
+    static ip::tcp::acceptor page_listener{service};
+    for (auto range = arguments["port-range"].as<unsigned short>();
+         range--; endpoint.port(endpoint.port() + 1)) {
+      page_listener.open(endpoint.protocol(), ec);
+      page_listener.set_option(socket_base::reuse_address{true}, ec);
+      page_listener.bind(endpoint, ec);
+      if (!ec)
+        break;
+      page_listener.close();
+    }
+    page_listener.listen(socket_base::max_connections, ec);
+    clog << "Prefork listening on port " << endpoint.port() << ": "
+         << ec.message() << '\n';
+    if (ec)
+      return 1;
+    port = endpoint.port();
+
+    int reports[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, reports)) {
+      clog << "Prefork report socket: " << strerror(errno) << '\n';
+      return 1;
+    }
+    worker_reports.assign(local::datagram_protocol{}, reports[0]);
+    prefork.on_exit = [](pid_t pid) {
+      lock_guard<mutex> lock{worker_stats_mutex};
+      worker_stats.erase(pid);
+    };
+    vector<string> worker_arguments(v, v + c);
+    worker_arguments.insert(
+        end(worker_arguments),
+        {"--listener-fd", to_string(page_listener.native_handle()),
+         "--stats-fd", to_string(reports[1])});
+    for (auto n = arguments["processes"].as<unsigned>(); n--;)
+      prefork.launch(worker_arguments,
+                     {page_listener.native_handle(), reports[1]});
+  }
+
+  // Connections to the page port stay on the thread that accepted them when
+  // there are accept threads.
+  static optional<io_pool> per_core;
+  if (auto n = arguments["accept-threads"].as<unsigned>())
+    per_core.emplace(n);
+
   signal_set signals{service, SIGINT, SIGTERM};
-  signals.async_wait([](const auto &ec, auto sig) { service.stop(); });
+  signals.async_wait([](const auto &ec, auto sig) {
+    prefork.terminate();
+    service.stop();
+    if (per_core)
+      per_core->stop();
+  });
 
   static ip::udp::endpoint stats_endpoint(
       ip::address::from_string(arguments["multicast-address"].as<string>()),
@@ -412,11 +941,14 @@ int main(int c, char **v) {
 
   spawn(service,
         [](yield_context yield) {
-          const auto port = arguments["port"].as<unsigned short>();
+          const auto pid = getpid();
           unsigned char buf[sizeof(stats) + (4 << 10)];
           array<const_buffer, 2> bufs{
               buffer(reinterpret_cast<const char *>(&port), sizeof(port)),
               buffer(buf, sizeof(buf))};
+          array<const_buffer, 2> report{
+              buffer(reinterpret_cast<const char *>(&pid), sizeof(pid)),
+              buffer(buf, sizeof(buf))};
           boost::system::error_code ec;
           steady_timer timer{service};
           while (true) {
@@ -425,14 +957,49 @@ int main(int c, char **v) {
             stats.webroot = web_root;
             stats.current_directory = filesystem::current_path();
             stats.user = getenv("USER");
-            serialize(stats, buf);
+            stats.on_stack_pool();
+            stats.on_connection_memory();
+            if (prefork_worker) {
+              serialize(stats, buf);
+              worker_reports.async_send(report, yield[ec]);
+              continue;
+            }
+            auto total = stats;
+            {
+              lock_guard<mutex> lock{worker_stats_mutex};
+              for (auto &worker : worker_stats)
+                total += worker.second;
+            }
+            serialize(total, buf);
             stats_socket.async_send_to(bufs, stats_endpoint, yield[ec]);
           }
         },
         boost::coroutines::attributes{12 << 10});
 
+  if (prefork_master)
+    spawn(service,
+          [](yield_context yield) {
+            pid_t pid;
+            server_statistics report;
+            unsigned char buf[sizeof(report) + (4 << 10)];
+            array<mutable_buffer, 2> bufs{
+                buffer(reinterpret_cast<char *>(&pid), sizeof(pid)),
+                buffer(buf, sizeof(buf))};
+            boost::system::error_code ec;
+            while (true) {
+              worker_reports.async_receive(bufs, yield[ec]);
+              if (ec)
+                break;
+              deserialize(buf, report);
+              lock_guard<mutex> lock{worker_stats_mutex};
+              worker_stats[pid] = report;
+            }
+          },
+          boost::coroutines::attributes{12 << 10});
+
   static map<pair<string, unsigned short>, server_statistics> known_servers;
-  server.register_service("known_servers", []() { return known_servers; }, "");
+  server.register_service("known_servers", []() { return known_servers; }, "",
+                          n2w::placement::inline_call);
 
   spawn(service,
         [](yield_context yield) {
@@ -453,49 +1020,45 @@ int main(int c, char **v) {
         },
         boost::coroutines::attributes{12 << 10});
 
-  static function<vector<uint8_t>(const vector<uint8_t> &)> null_ref;
-  struct websocket_handler {
-    reference_wrapper<const function<vector<uint8_t>(const vector<uint8_t> &)>>
-        service = null_ref;
-
+  // Serves the calls of n2w::call_protocol from the services loaded.
+  struct websocket_handler : n2w::call_protocol<websocket_handler> {
+    // Lists the ids of the services loaded as "id:hash" in hexadecimal, the
+    // hash being the FNV-1a of the service pointer.
     void decorate(const http::request<http::string_body> &request,
                   http::response<http::string_body> &response) {
       if (!request.count(http::field::sec_websocket_protocol))
         return;
       response.set(http::field::sec_websocket_protocol, "n2w");
 
-      auto services = accumulate(
-          cbegin(plugins), cend(plugins), vector<string>{},
-          [](auto &all_services, auto &plugin) {
-            auto services = plugin.second.get_services();
-            copy(cbegin(services), cend(services), back_inserter(all_services));
-            return all_services;
-          });
-      auto server_apis = server.get_services();
-      move(begin(server_apis), end(server_apis), back_inserter(services));
-
-      response.set(
-          "X-n2w-api-list",
-          accumulate(
-              cbegin(services), cend(services), string{},
-              [specials = regex{"\\\\|\"|\r"}](auto &services, auto &service) {
-                return services + (services.empty() ? "" : " ") + '"' +
-                       regex_replace(service, specials, "\\$0") + '"';
-              }));
-    }
-
-    void operator()(string message) {
-      for (auto &plugin : plugins) {
-        service = cref(plugin.second.get_function(message));
-        if (service.get())
-          return;
+      ostringstream api_list;
+      api_list << hex;
+      auto table = atomic_load(&dispatch);
+      for (uint32_t id = 0; id < table->entries.size(); ++id) {
+        auto &service = table->entries[id];
+        if (!service.function)
+          continue;
+        if (api_list.tellp() > 0)
+          api_list << ' ';
+        api_list << id << ':' << pointer_hash(service.pointer);
       }
-      service = server.get_function(message);
+      response.set("X-n2w-api-list", api_list.str());
     }
-    vector<uint8_t> operator()(vector<uint8_t> message) {
-      if (!service.get())
+
+    n2w::call_target service(uint32_t id) {
+      auto table = atomic_load(&dispatch);
+      if (id >= table->entries.size())
         return {};
-      return service(message);
+      auto &e = table->entries[id];
+      return {table, e.function, e.stream, e.where};
+    }
+
+    bool runs_inline(const vector<uint8_t> &message) {
+      return find_service(message).where == n2w::placement::inline_call;
+    }
+
+    worker_pool *worker(const vector<uint8_t> &message) {
+      return find_service(message).where == n2w::placement::worker ? &workers
+                                                                   : nullptr;
     }
   };
 
@@ -506,6 +1069,9 @@ int main(int c, char **v) {
     void report_task_end(server_statistics::time_point t) {
       stats.on_task_end();
     }
+    void report_pause(server_statistics::time_point t) { stats.on_pause(); }
+    void report_resume(server_statistics::time_point t) { stats.on_resume(); }
+    void report_timeout(n2w::timeout_kind kind) { stats.on_timeout(kind); }
     void report_accept(server_statistics::time_point t) { stats.on_accept(t); }
     void report_connect(server_statistics::time_point t) {
       stats.on_connect(t);
@@ -583,14 +1149,27 @@ int main(int c, char **v) {
     }
   };
 
-  accept<http_handler>(
-      service, ip::address::from_string(arguments["address"].as<string>()),
-      arguments["port"].as<unsigned short>());
+  const auto address =
+      ip::address::from_string(arguments["address"].as<string>());
+  if (prefork_worker) {
+    inherited_listener listener{address.is_v6() ? ip::tcp::v6()
+                                                : ip::tcp::v4(),
+                                arguments["listener-fd"].as<int>()};
+    if (per_core)
+      accept<http_handler>(*per_core, listener);
+    else
+      accept<http_handler>(service, listener);
+  } else if (!prefork_master) {
+    if (per_core)
+      accept<http_handler>(*per_core, address, port);
+    else
+      accept<http_handler>(service, address, port);
+  }
 
+  // The other ports stay with a prefork master.
   struct dummy_handler {};
-  accept<dummy_handler>(
-      service, ip::address::from_string(arguments["address"].as<string>()),
-      9003);
+  if (!prefork_worker)
+    accept<dummy_handler>(service, address, 9003);
 
   struct ws_only_handler : public stats_reporter {
     struct websocket_handler_type {
@@ -612,9 +1191,8 @@ int main(int c, char **v) {
     };
   };
 
-  accept<ws_only_handler>(
-      service, ip::address::from_string(arguments["address"].as<string>()),
-      9002);
+  if (!prefork_worker)
+    accept<ws_only_handler>(service, address, 9002);
 
   struct http_requester : public stats_reporter {
     struct websocket_handler_type {
@@ -624,13 +1202,11 @@ int main(int c, char **v) {
 
       void inspect(http::response<http::string_body> &response) {
         clog << "Inspecting upgrade response\n";
-        regex rx{R"(^"|" "|"$)"};
-        auto api_list = response["X-n2w-api-list"];
-        for_each(
-            cregex_token_iterator{api_list.begin(), api_list.end(), rx, -1},
-            {}, [rx = regex{"\\\\(.)"}](const auto &api) {
-              clog << regex_replace(api.str(), rx, "$1") << '\n';
-            });
+        auto field = response["X-n2w-api-list"];
+        istringstream api_list{string{field.begin(), field.end()}};
+        string api;
+        while (api_list >> api)
+          clog << api << '\n';
       }
     };
 
@@ -662,14 +1238,23 @@ int main(int c, char **v) {
   auto num_threads = thread::hardware_concurrency();
   clog << "Hardware concurrency: " << num_threads << '\n';
   vector<thread> threadpool;
-  generate_n(back_inserter(threadpool), num_threads ? num_threads : 5, []() {
-    return thread{[]() {
+  if (per_core)
+    per_core->start([](io_service &s) {
       stats.on_thread_start();
-      service.run();
+      s.run();
       stats.on_thread_end();
-    }};
-  });
+    });
+  else
+    generate_n(back_inserter(threadpool), num_threads ? num_threads : 5, []() {
+      return thread{[]() {
+        stats.on_thread_start();
+        service.run();
+        stats.on_thread_end();
+      }};
+    });
   service.run();
+  for (auto &t : threadpool)
+    t.join();
   stats.on_shutdown();
 
   return 0;
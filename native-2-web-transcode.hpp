@@ -0,0 +1,230 @@
+#ifndef _NATIVE_2_WEB_TRANSCODE_HPP_
+#define _NATIVE_2_WEB_TRANSCODE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+namespace n2w {
+namespace transcode_detail {
+using namespace std;
+
+// Strings travel as UTF-8. char16_t strings are UTF-16, char32_t strings are
+// UTF-32 and wchar_t strings are whichever of the two fits wchar_t. Code units
+// that do not make a code point, such as lone surrogates, go out as U+FFFD.
+template <typename T>
+constexpr bool is_utf16 = sizeof(T) == sizeof(char16_t);
+
+constexpr char32_t replacement_character = 0xFFFD;
+
+template <typename T> constexpr char32_t unit(T t) {
+  return static_cast<make_unsigned_t<T>>(t);
+}
+
+// Whole blocks of ASCII are tested with one comparison and narrowed or widened
+// in one loop so the compiler can vectorize both.
+constexpr size_t block = 16;
+
+template <typename T> bool ascii_block(const T *s) {
+  char32_t units = 0;
+  for (size_t j = 0; j < block; ++j)
+    units |= unit(s[j]);
+  return units < 0x80;
+}
+
+// Copies the ASCII at s[k] to out, a block at a time where it can, and stops
+// at the next unit that is not ASCII. Works on locals, byte stores could alias
+// k and out.
+template <typename T, typename U>
+void copy_ascii(const T *s, size_t n, size_t &k, U *&out) {
+  auto j = k;
+  auto o = out;
+  for (; j + block <= n && ascii_block(s + j); j += block, o += block)
+    for (size_t b = 0; b < block; ++b)
+      o[b] = static_cast<U>(s[j + b]);
+  for (; j < n && unit(s[j]) < 0x80; ++j)
+    *o++ = static_cast<U>(s[j]);
+  k = j;
+  out = o;
+}
+
+// Reads the code point at s[k], advancing k past it.
+template <typename T>
+char32_t next_code_point(const T *s, size_t n, size_t &k) {
+  char32_t c = unit(s[k++]);
+  if
+    constexpr(is_utf16<T>) {
+      if (c < 0xD800 || c > 0xDFFF)
+        return c;
+      if (c > 0xDBFF || k == n)
+        return replacement_character;
+      char32_t low = unit(s[k]);
+      if (low < 0xDC00 || low > 0xDFFF)
+        return replacement_character;
+      ++k;
+      return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+    }
+  else
+    return c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF) ? replacement_character
+                                                        : c;
+}
+
+inline uint8_t *encode_utf8(char32_t c, uint8_t *out) {
+  if (c < 0x80)
+    *out++ = static_cast<uint8_t>(c);
+  else if (c < 0x800) {
+    *out++ = static_cast<uint8_t>(0xC0 | c >> 6);
+    *out++ = static_cast<uint8_t>(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    *out++ = static_cast<uint8_t>(0xE0 | c >> 12);
+    *out++ = static_cast<uint8_t>(0x80 | (c >> 6 & 0x3F));
+    *out++ = static_cast<uint8_t>(0x80 | (c & 0x3F));
+  } else {
+    *out++ = static_cast<uint8_t>(0xF0 | c >> 18);
+    *out++ = static_cast<uint8_t>(0x80 | (c >> 12 & 0x3F));
+    *out++ = static_cast<uint8_t>(0x80 | (c >> 6 & 0x3F));
+    *out++ = static_cast<uint8_t>(0x80 | (c & 0x3F));
+  }
+  return out;
+}
+
+// Extra bytes, past one per unit, that to_utf8 writes for c. A valid
+// surrogate pair comes out two bytes short of the six this counts for it.
+template <typename T> constexpr size_t extra_utf8_bytes(char32_t c) {
+  if
+    constexpr(is_utf16<T>) return (c >= 0x80) + (c >= 0x800);
+  else
+    return (c >= 0x80) + (c >= 0x800) + (c >= 0x10000 && c <= 0x10FFFF);
+}
+
+// Bytes to_utf8 writes for s. Blocks keep to a fixed trip count so the
+// compiler can vectorize them.
+template <typename T> size_t utf8_size(const T *s, size_t n) {
+  if
+    constexpr(sizeof(T) == 1) return n;
+  else {
+    size_t size = n, k = 0;
+    char32_t surrogates = 0;
+    for (; k + block <= n; k += block) {
+      uint32_t extra = 0;
+      for (size_t j = 0; j < block; ++j) {
+        auto c = unit(s[k + j]);
+        extra += extra_utf8_bytes<T>(c);
+        surrogates |= (c & 0xF800) == 0xD800;
+      }
+      size += extra;
+    }
+    for (; k < n; ++k) {
+      size += extra_utf8_bytes<T>(unit(s[k]));
+      surrogates |= (unit(s[k]) & 0xF800) == 0xD800;
+    }
+    if
+      constexpr(is_utf16<T>) {
+        if (surrogates)
+          for (k = 0; k + 1 < n; ++k)
+            if ((unit(s[k]) & 0xFC00) == 0xD800 &&
+                (unit(s[k + 1]) & 0xFC00) == 0xDC00) {
+              size -= 2;
+              ++k;
+            }
+      }
+    return size;
+  }
+}
+
+// Writes s as UTF-8 to out, which has room for utf8_size(s, n) bytes.
+template <typename T> uint8_t *to_utf8(const T *s, size_t n, uint8_t *out) {
+  for (size_t k = 0; k < n;)
+    if (unit(s[k]) < 0x80)
+      copy_ascii(s, n, k, out);
+    else
+      out = encode_utf8(next_code_point(s, n, k), out);
+  return out;
+}
+
+// Decodes the code point at s[k], advancing k past it. Overlong forms,
+// surrogates, code points past U+10FFFF and truncated sequences are invalid.
+inline bool decode_utf8(const uint8_t *s, size_t n, size_t &k, char32_t &c) {
+  auto continuation = [s](size_t j) { return (s[j] & 0xC0) == 0x80; };
+  uint8_t b = s[k];
+  if (b < 0xC2 || b > 0xF4)
+    return false;
+  if (b < 0xE0) {
+    if (n - k < 2 || !continuation(k + 1))
+      return false;
+    c = (b & 0x1F) << 6 | (s[k + 1] & 0x3F);
+    k += 2;
+    return true;
+  }
+  if (b < 0xF0) {
+    if (n - k < 3 || !continuation(k + 1) || !continuation(k + 2) ||
+        (b == 0xE0 && s[k + 1] < 0xA0) || (b == 0xED && s[k + 1] > 0x9F))
+      return false;
+    c = (b & 0x0F) << 12 | (s[k + 1] & 0x3F) << 6 | (s[k + 2] & 0x3F);
+    k += 3;
+    return true;
+  }
+  if (n - k < 4 || !continuation(k + 1) || !continuation(k + 2) ||
+      !continuation(k + 3) || (b == 0xF0 && s[k + 1] < 0x90) ||
+      (b == 0xF4 && s[k + 1] > 0x8F))
+    return false;
+  c = (b & 0x07) << 18 | (s[k + 1] & 0x3F) << 12 | (s[k + 2] & 0x3F) << 6 |
+      (s[k + 3] & 0x3F);
+  k += 4;
+  return true;
+}
+
+// Replaces t with the UTF-8 in s. Returns false, leaving t unspecified, if s
+// is not valid UTF-8.
+template <typename T, typename... Traits>
+bool from_utf8(const uint8_t *s, size_t n, basic_string<T, Traits...> &t) {
+  t.resize(n);
+  auto out = &t[0];
+  for (size_t k = 0; k < n;) {
+    if (s[k] < 0x80) {
+      copy_ascii(s, n, k, out);
+      continue;
+    }
+    char32_t c;
+    if (!decode_utf8(s, n, k, c))
+      return false;
+    if
+      constexpr(is_utf16<T>) {
+        if (c >= 0x10000) {
+          c -= 0x10000;
+          *out++ = static_cast<T>(0xD800 + (c >> 10));
+          c = 0xDC00 + (c & 0x3FF);
+        }
+      }
+    *out++ = static_cast<T>(c);
+  }
+  t.resize(out - &t[0]);
+  return true;
+}
+
+// A lone char16_t or wchar_t goes on the wire as its code point.
+template <typename T> char32_t to_code_point(T t) {
+  size_t k = 0;
+  return next_code_point(&t, 1, k);
+}
+template <typename T> T from_code_point(char32_t c) {
+  if
+    constexpr(is_utf16<T>) return static_cast<T>(
+        c > 0xFFFF || (c >= 0xD800 && c <= 0xDFFF) ? replacement_character
+                                                   : c);
+  else
+    return static_cast<T>(c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)
+                              ? replacement_character
+                              : c);
+}
+}
+
+using transcode_detail::utf8_size;
+using transcode_detail::to_utf8;
+using transcode_detail::from_utf8;
+using transcode_detail::to_code_point;
+using transcode_detail::from_code_point;
+}
+
+#endif
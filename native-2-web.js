@@ -17,6 +17,17 @@ var sizes = {
   'setFloat64' : 8,
 };
 
+var column_arrays = {
+  'Int8' : Int8Array,
+  'Int16' : Int16Array,
+  'Int32' : Int32Array,
+  'Uint8' : Uint8Array,
+  'Uint16' : Uint16Array,
+  'Uint32' : Uint32Array,
+  'Float32' : Float32Array,
+  'Float64' : Float64Array,
+};
+
 var __n2w_deleted_value = {};
 
 //////////////////////////////////
@@ -160,6 +171,42 @@ function read_associative(data, offset, key_reader, value_reader) {
   return read_associative_bounded(data, offset, key_reader, value_reader, size);
   }
 
+// Number columns sit at a multiple of their element size from origin, where
+// the columns start. They are viewed in place when that lands on a multiple
+// of the element size in the buffer as well, and copied when it does not.
+function read_column(data, offset, type, size, origin) {
+  let array = column_arrays[type], bytes = array.BYTES_PER_ELEMENT;
+  offset += (bytes - (offset - origin) % bytes) % bytes;
+  let begin = data.byteOffset + offset;
+  let column = begin % bytes == 0
+                   ? new array(data.buffer, begin, size)
+                   : new array(data.buffer.slice(begin, begin + size * bytes));
+  return [ column, offset + size * bytes ];
+  }
+
+function read_string_column(data, offset, size, origin) {
+  let ends, strings = [];
+  [ends, offset] = read_column(data, offset, 'Uint32', size + 1, origin);
+  for (let n = 0; n < size; ++n) {
+    let u = [];
+    for (let i = offset + ends[n], end = offset + ends[n + 1]; i < end;) {
+      let c = 0;
+      [c, i] = read_codepoint(data, i);
+      u.push(c);
+      }
+    strings.push(String.fromCodePoint(...u));
+    }
+  return [ strings, offset + ends[size] ];
+  }
+
+function read_columns(data, offset, reader) {
+  let size, columns, origin = offset;
+  [size, offset] = read_number(data, offset, 'getUint32');
+  [columns, offset] = reader(data, offset, size, origin);
+  columns['#length'] = size;
+  return [ columns, offset ];
+  }
+
 function subdivide(source, dest, extents) {
   if (extents.length == 1) {
     for (let i = 0, end = extents[0]; i < end; ++i) {
@@ -376,6 +423,26 @@ function write_variant(object, writers) {
 // Native to HTML generator //
 //////////////////////////////
 
+function column_row(columns, n) {
+  let row = {};
+  Object.keys(columns).filter(k => k != '#length').forEach(k => {
+    let column = columns[k];
+    row[k] = Array.isArray(column) || ArrayBuffer.isView(column)
+                 ? column[n]
+                 : column_row(column, n);
+  });
+  return row;
+  }
+
+function columns_to_rows(columns) {
+  if (columns['#length'] === undefined)
+    return columns;
+  let rows = [];
+  for (let n = 0; n < columns['#length']; ++n)
+    rows.push(column_row(columns, n));
+  return rows;
+  }
+
 function create_gatherer() { return d3.dispatch('gather'); }
 
 function dispatch(dispatcher, value) { dispatcher.on('gather', value); }
@@ -1302,38 +1369,147 @@ function N2WGenerator() {
 // WebSocket management for native to web APIs //
 /////////////////////////////////////////////////
 
-function create_service(pointer, writer, reader) {
+// Calls share their websocket. A call is one binary message holding a request
+// id, the service id and the arguments. Its reply leads with the request
+// id and a status, so replies may come back in any order. The 8 byte header
+// keeps columns aligned for typed array views.
+function call_service(ws, service, args, callback) {
+  if (!ws.n2w_calls) {
+    ws.n2w_calls = new Map();
+    ws.n2w_parts = new Map();
+    ws.n2w_next_id = 0;
+    ws.binaryType = 'arraybuffer';
+    ws.addEventListener('message', function(e) {
+      if (!(e.data instanceof ArrayBuffer) || e.data.byteLength < 8)
+        return;
+      let header = new DataView(e.data, 0, 8);
+      let id = header.getUint32(0, true);
+      let call = ws.n2w_calls.get(id);
+      if (!call)
+        return;
+      // Large replies come in pieces with status 3 (partial) until the last.
+      let parts = ws.n2w_parts.get(id);
+      if (header.getUint32(4, true) == 3) {
+        if (!parts)
+          ws.n2w_parts.set(id, parts = []);
+        parts.push(new Uint8Array(e.data, 8));
+        return;
+        }
+      let data = e.data;
+      if (parts) {
+        ws.n2w_parts.delete(id);
+        parts.push(new Uint8Array(data, 8));
+        let whole = new Uint8Array(
+            parts.reduce((size, part) => size + part.byteLength, 8));
+        whole.set(new Uint8Array(data, 0, 8));
+        parts.reduce((offset, part) => {
+          whole.set(part, offset);
+          return offset + part.byteLength;
+        }, 8);
+        data = whole.buffer;
+        }
+      ws.n2w_calls.delete(id);
+      call(header.getUint32(4, true), new DataView(data));
+    });
+    }
+  let id = ws.n2w_next_id;
+  ws.n2w_next_id = (id + 1) >>> 0;
+  ws.n2w_calls.set(id, callback);
+  ws.send(concat_buffer(concat_buffer(write_number(id, 'setUint32'),
+                                     write_number(service, 'setUint32')),
+                       args));
+  return id;
+  }
+
+function create_service(service, writer, reader) {
   return function(ws) {
     ws = typeof(ws) == 'function' ? ws() : ws;
-    let listener = function(e) {
-      ws.removeEventListener('message', listener);
-      let ret = reader(new DataView(e.data), 0);
-      if (ret)
-        this.callback(ret[0]);
-      else
-        this.callback();
-    }.bind(this);
-    ws.binaryType = 'arraybuffer';
 
     let args = [...arguments ];
     args.shift();
 
-    this.then = function(handler) {
-      this.callback = handler;
-      ws.addEventListener('message', listener);
-      ws.send(pointer);
+    this.then = function(handler, on_error) {
       args = writer(args) || new ArrayBuffer();
-      ws.send(args);
+      call_service(ws, service, args, function(status, data) {
+        if (status != 0) {
+          if (on_error)
+            on_error(status);
+          return;
+          }
+        let ret = reader(data, 8);
+        if (ret)
+          handler(ret[0]);
+        else
+          handler();
+      });
+    }.bind(this);
+
+    return this;
+  };
+  }
+// A stream service takes a Blob or ArrayBuffer as its last argument. The call
+// carries its 64 bit length ahead of the other arguments, then the bytes
+// follow in chunks led by the request id and service id 0xffffffff. Streams
+// on a websocket go one at a time, as the server stops reading the websocket
+// while a stream's window is full. A call answered before its bytes are all
+// sent, such as one refused with status 4 (busy), sends no more of them.
+function create_stream_service(service, writer, reader) {
+  const chunk_size = 1 << 16;
+  return function(ws) {
+    ws = typeof(ws) == 'function' ? ws() : ws;
+
+    let args = [...arguments ];
+    args.shift();
+    let data = args.pop();
+    data = data instanceof Blob ? data : new Blob([ data ]);
+
+    this.then = function(handler, on_error) {
+      let length = new DataView(new ArrayBuffer(8));
+      length.setUint32(0, data.size % 0x100000000, true);
+      length.setUint32(4, Math.floor(data.size / 0x100000000), true);
+      args = concat_buffer(length.buffer, writer(args) || new ArrayBuffer());
+      let send_chunks = async function() {
+        let sent;
+        let done = false;
+        let replied = new Promise(resolve => sent = resolve);
+        let id = call_service(ws, service, args, function(status, reply) {
+          done = true;
+          sent();
+          if (status != 0) {
+            if (on_error)
+              on_error(status);
+            return;
+            }
+          let ret = reader(reply, 8);
+          if (ret)
+            handler(ret[0]);
+          else
+            handler();
+        });
+        let header = concat_buffer(write_number(id, 'setUint32'),
+                                   write_number(0xffffffff, 'setUint32'));
+        for (let offset = 0; offset < data.size && !done;
+             offset += chunk_size) {
+          while (ws.bufferedAmount > 4 * chunk_size)
+            await new Promise(resolve => setTimeout(resolve, 10));
+          if (done)
+            break;
+          let chunk = data.slice(offset, offset + chunk_size);
+          ws.send(new Blob([ header, chunk ]));
+          }
+        return replied;
+      };
+      ws.n2w_streams = (ws.n2w_streams || Promise.resolve())
+                           .then(send_chunks, send_chunks);
     }.bind(this);
 
     return this;
   };
   }
 function create_push_notifier(pointer, writer, reader) {}
-function create_kaonashi(pointer, writer) {
+function create_kaonashi(service, writer) {
   return function(ws) {
-    ws.send(pointer);
-    ws.send(writer(...arguments));
+    call_service(ws, service, writer(...arguments), function() {});
   };
   }
 
@@ -0,0 +1,182 @@
+#include <native-2-web-plugin.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+using payload = std::vector<double>;
+
+struct packed_record {
+  std::int32_t id;
+  float x, y, z;
+};
+N2W__READ_WRITE_SPEC(packed_record, (id)(x)(y)(z));
+
+struct padded_record : packed_record {
+  char tag;
+  double weight;
+  std::array<std::int16_t, 3> flags;
+};
+N2W__READ_WRITE_SPEC(padded_record, (tag)(weight)(flags), packed_record);
+
+template <typename F> double measure(std::size_t iterations, F &&f) {
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i)
+    f();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+std::string find_service(n2w::plugin &plugin, const std::string &name) {
+  for (auto &s : plugin.get_services())
+    if (plugin.get_name(s) == name)
+      return s;
+  return {};
+}
+
+template <typename... Ts>
+void bench_call(n2w::plugin &plugin, const char *name, std::size_t iterations,
+                const Ts &... args) {
+  std::vector<std::uint8_t> in;
+  n2w::serialize(std::make_tuple(args...), back_inserter(in));
+  const auto &service =
+      plugin.get_function(find_service(plugin, name)).get();
+  auto ns = measure(iterations,
+                    [&service, &in]() { service({in.data(), in.size()}, 0); });
+  std::cout << name << ": " << ns << " ns/call, "
+            << ns / sizeof...(Ts) << " ns/argument, " << in.size()
+            << " bytes\n";
+}
+
+template <typename T>
+void bench_round_trip(const char *name, std::size_t iterations, const T &t) {
+  std::vector<std::uint8_t> buf;
+  auto encode = measure(iterations, [&buf, &t]() {
+    buf.clear();
+    n2w::serialize(t, back_inserter(buf));
+  });
+  T u;
+  auto decode = measure(iterations, [&buf, &u]() {
+    u = T{};
+    n2w::deserialize(cbegin(buf), u);
+  });
+  std::cout << name << ": encode " << encode << " ns, decode " << decode
+            << " ns, " << buf.size() << " bytes, "
+            << std::boolalpha << (t == u) << '\n';
+}
+
+int main(int, char **) {
+  constexpr std::size_t iterations = 2000;
+  payload p(1000, 3.14);
+
+  std::cout << "Argument decode cost by arity\n";
+  n2w::plugin plugin;
+  plugin.register_service(
+      "arity_1", [](payload a) { return a.size(); }, "");
+  plugin.register_service(
+      "arity_2", [](payload a, payload b) { return a.size() + b.size(); }, "");
+  plugin.register_service("arity_4",
+                          [](payload a, payload b, payload c, payload d) {
+                            return a.size() + b.size() + c.size() + d.size();
+                          },
+                          "");
+  plugin.register_service(
+      "arity_8",
+      [](payload a, payload b, payload c, payload d, payload e, payload f,
+         payload g, payload h) {
+        return a.size() + b.size() + c.size() + d.size() + e.size() +
+               f.size() + g.size() + h.size();
+      },
+      "");
+
+  bench_call(plugin, "arity_1", iterations, p);
+  bench_call(plugin, "arity_2", iterations, p, p);
+  bench_call(plugin, "arity_4", iterations, p, p, p, p);
+  bench_call(plugin, "arity_8", iterations, p, p, p, p, p, p, p, p);
+
+  std::cout << "\nOwning versus view arguments\n";
+  plugin.register_service(
+      "owning", [](payload a, std::string s) { return a.size() + s.size(); },
+      "");
+  plugin.register_service("view",
+                          [](n2w::numbers_view<double> a, std::string_view s) {
+                            return a.size() + s.size();
+                          },
+                          "");
+  std::string text(1 << 16, 'x');
+  bench_call(plugin, "owning", iterations, p, text);
+  bench_call(plugin, "view", iterations, p, text);
+
+  std::cout << "\nContiguous arithmetic sequences\n";
+  bench_round_trip("vector<double>", 200, std::vector<double>(1 << 20, 2.71));
+  bench_round_trip("string", 200, std::string(1 << 20, 'x'));
+  bench_round_trip("array<int32_t, 4096>", 20000,
+                   std::array<std::int32_t, 4096>{});
+
+  std::cout << "\nFixed layout records\n";
+  std::vector<packed_record> packed(100000);
+  std::vector<padded_record> padded(100000);
+  for (std::int32_t i = 0; i < 100000; ++i) {
+    packed[i] = {i, 1.0f * i, 2.0f * i, 3.0f * i};
+    padded[i].id = i;
+    padded[i].tag = static_cast<char>(i);
+    padded[i].weight = 0.5 * i;
+    padded[i].flags = {{1, 2, 3}};
+  }
+  bench_round_trip("vector<packed_record>", 200, packed);
+  bench_round_trip("vector<padded_record>", 200, padded);
+  bench_round_trip("vector<tuple<int32_t, double>>", 200,
+                   std::vector<std::tuple<std::int32_t, double>>(100000));
+
+  std::cout << "\nColumns\n";
+  n2w::columns<padded_record> padded_columns(padded);
+  bench_round_trip("vector<padded_record>", 200, padded);
+  bench_round_trip("columns<padded_record>", 200, padded_columns);
+  std::vector<std::tuple<std::int32_t, std::string, double>> named(100000);
+  for (std::int32_t i = 0; i < 100000; ++i)
+    named[i] = {i, "row" + std::to_string(i), 0.5 * i};
+  n2w::columns<std::tuple<std::int32_t, std::string, double>> named_columns(
+      named);
+  bench_round_trip("vector<tuple<int32_t, string, double>>", 20, named);
+  bench_round_trip("columns<tuple<int32_t, string, double>>", 20,
+                   named_columns);
+
+  std::cout << "\nAssociative containers\n";
+  for (std::size_t size = 10; size <= 1000000; size *= 10) {
+    std::map<std::string, double> ordered;
+    std::unordered_map<std::string, double> unordered;
+    for (std::size_t i = 0; i < size; ++i) {
+      ordered.emplace("key" + std::to_string(i), 0.5 * i);
+      unordered.emplace("key" + std::to_string(i), 0.5 * i);
+    }
+    auto iterations = std::max<std::size_t>(1, 100000 / size);
+    bench_round_trip(("map<string, double> " + std::to_string(size)).c_str(),
+                     iterations, ordered);
+    bench_round_trip(
+        ("unordered_map<string, double> " + std::to_string(size)).c_str(),
+        iterations, unordered);
+  }
+
+  std::cout << "\nType metadata\n";
+  std::cout << "mangled<map<string, padded_record>>: "
+            << measure(100000,
+                       []() -> const std::string & {
+                         return n2w::mangled<
+                             std::map<std::string, padded_record>>();
+                       })
+            << " ns\n";
+  bench_round_trip("u16string", 20000, std::u16string(64, u'x'));
+
+  std::cout << "\nWide strings\n";
+  bench_round_trip("u16string ascii", 200, std::u16string(1 << 16, u'x'));
+  bench_round_trip("u16string mixed", 200,
+                   std::u16string(1 << 14, u'x') +
+                       std::u16string(1 << 14, u'\u00e9') +
+                       std::u16string(1 << 14, u'\u20ac'));
+  bench_round_trip("wstring ascii", 200, std::wstring(1 << 16, L'x'));
+  bench_round_trip("vector<u16string>", 200,
+                   std::vector<std::u16string>(4096, u"native-2-web"));
+
+  return 0;
+}
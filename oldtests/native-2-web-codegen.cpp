@@ -0,0 +1,49 @@
+// Checks for structure reflection: build with `make n2wc` and run it. The
+// member pointers of a reflected structure must be compile time constants,
+// which is what lets the compiler fold member access down to plain field
+// access, and a structure must come back whole from its wire form.
+#include <native-2-web-readwrite.hpp>
+
+#include <iostream>
+
+struct options {
+  std::optional<bool> spawned = false;
+  std::optional<std::string> address = "::";
+  std::optional<unsigned short> port = 9001;
+  std::optional<unsigned> worker_threads = 0;
+  std::optional<std::string> multicast_address = "233.252.18.0";
+  std::optional<unsigned short> multicast_port = 9002;
+};
+
+N2W__BINARY_SPEC(options, N2W__MEMBERS(address, port, worker_threads,
+                                       multicast_address, multicast_port));
+
+constexpr auto members = n2w::reflection<options>::members;
+static_assert(std::get<0>(members) == &options::address &&
+                  std::get<1>(members) == &options::port &&
+                  std::get<4>(members) == &options::multicast_port,
+              "Member pointers are not compile time constants");
+
+int main(int, char **) {
+  options in;
+  in.address = "127.0.0.1";
+  in.port = 9100;
+  in.worker_threads = 3;
+  in.multicast_address = std::nullopt;
+
+  std::vector<std::uint8_t> buf(n2w::serialized_size(in));
+  auto end = n2w::serialize(in, buf.data());
+  // Absent options leave what they are decoded onto alone.
+  options out;
+  out.address = "";
+  out.port = out.worker_threads = out.multicast_port = 0;
+  n2w::deserialize(buf.data(), out);
+
+  auto passed = end == buf.data() + buf.size() &&
+                out.address == in.address && out.port == in.port &&
+                out.worker_threads == in.worker_threads &&
+                out.multicast_address == options{}.multicast_address &&
+                out.multicast_port == in.multicast_port;
+  std::cout << (passed ? "Passed\n" : "Failed\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+#include "native-2-web-test-server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+using namespace n2w_test;
+
+std::atomic_int running{0}, peak{0}, pauses{0};
+
+struct slow_echo_handler : not_found_handler {
+  struct websocket_handler_type {
+    std::vector<std::uint8_t> operator()(std::vector<std::uint8_t> message) {
+      auto now = ++running;
+      for (auto seen = peak.load(); now > seen;)
+        peak.compare_exchange_weak(seen, now);
+      std::this_thread::sleep_for(std::chrono::milliseconds{2});
+      --running;
+      return message;
+    }
+  };
+
+  void report_pause(std::chrono::system_clock::time_point) { ++pauses; }
+};
+
+// Writes calls without reading their replies, so that the server has to stop
+// reading them, then reads every reply back.
+int main(int, char **) {
+  quiet_log();
+  constexpr std::size_t calls = 2000;
+  constexpr std::size_t max_in_flight = 2;
+  n2w::flow_limits::max_in_flight = max_in_flight;
+  n2w::flow_limits::max_outbound_bytes = 1 << 20;
+
+  io_service service;
+  n2w::accept<slow_echo_handler>(
+      service, ip::address::from_string("127.0.0.1"), 9014);
+  server_threads threads{service, at_least(4)};
+
+  websocket_client client{9014};
+  auto &ws = client.ws;
+
+  std::atomic_size_t written{0};
+  std::thread flood([&ws, &written]() {
+    std::vector<std::uint8_t> call(16 << 10, 0x2a);
+    for (std::size_t i = 0; i < calls; ++i, ++written)
+      ws.write(buffer(call));
+  });
+  std::this_thread::sleep_for(std::chrono::seconds{1});
+  auto written_unread = written.load();
+
+  boost::asio::streambuf buf;
+  std::size_t replies = 0;
+  for (; replies < calls; ++replies) {
+    ws.read(buf);
+    buf.consume(buf.size());
+  }
+  flood.join();
+  ws.close(websocket::close_code::normal);
+
+  std::cout << "Calls written before reading replies: " << written_unread
+            << " of " << calls << '\n'
+            << "Replies read: " << replies << '\n'
+            << "Most calls running at once: " << peak << " of "
+            << max_in_flight << '\n'
+            << "Read pauses: " << pauses << '\n';
+
+  auto passed = written_unread < calls && replies == calls &&
+                peak <= static_cast<int>(max_in_flight) && pauses > 0;
+  std::cout << (passed ? "Passed\n" : "Failed\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+#include "native-2-web-test-server.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+using namespace n2w_test;
+
+// Resident bytes of this process.
+std::size_t resident() {
+  std::size_t pages = 0;
+  std::ifstream statm{"/proc/self/statm"};
+  statm >> pages >> pages;
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Opens websockets to a server in this process and leaves them idle, then
+// reports what the server holds for each. The clients upgrade by hand over
+// bare sockets so that they add little to the resident size measured.
+// Pass the number of websockets; each takes two descriptors.
+int main(int argc, char **argv) {
+  quiet_log();
+  std::size_t count = argc > 1 ? std::stoul(argv[1]) : 400;
+  n2w::connection_timeouts::idle = std::chrono::milliseconds{0};
+
+  io_service service;
+  n2w::accept<echo_handler>(service, ip::address::from_string("127.0.0.1"),
+                            9016);
+  server_threads thread{service, 1};
+
+  io_service client_service;
+  std::string upgrade = "GET / HTTP/1.1\r\n"
+                        "Host: 127.0.0.1\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: upgrade\r\n"
+                        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                        "Sec-WebSocket-Version: 13\r\n\r\n";
+  std::vector<ip::tcp::socket> sockets;
+  sockets.reserve(count);
+  auto before = resident();
+  for (std::size_t i = 0; i < count; ++i) {
+    sockets.emplace_back(client_service);
+    sockets.back().connect({ip::address::from_string("127.0.0.1"), 9016});
+    write(sockets.back(), buffer(upgrade));
+    boost::asio::streambuf response;
+    read_until(sockets.back(), response, "\r\n\r\n");
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds{500});
+  auto after = resident();
+
+  auto per_connection = [count](std::size_t bytes) {
+    return bytes / std::max<std::size_t>(count, 1);
+  };
+  auto total = n2w::connection_memory::objects +
+               n2w::connection_memory::read_buffers +
+               n2w::connection_memory::queued_replies +
+               n2w::stack_pool::mapped_bytes;
+  std::cout << "Idle websockets: " << n2w::connection_memory::connections
+            << '\n'
+            << "Bytes per connection:\n"
+            << "  objects: " << per_connection(n2w::connection_memory::objects)
+            << '\n'
+            << "  read buffers: "
+            << per_connection(n2w::connection_memory::read_buffers) << '\n'
+            << "  queued replies: "
+            << per_connection(n2w::connection_memory::queued_replies) << '\n'
+            << "  coroutine stacks mapped: "
+            << per_connection(n2w::stack_pool::mapped_bytes) << '\n'
+            << "  counted: " << per_connection(total) << '\n'
+            << "  resident: " << per_connection(after - before) << '\n'
+            << "100000 idle websockets: "
+            << per_connection(after - before) * 100000 / (1 << 20)
+            << " MiB resident\n";
+
+  sockets.clear();
+  return 0;
+}
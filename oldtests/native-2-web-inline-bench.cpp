@@ -0,0 +1,54 @@
+#include "native-2-web-test-server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+using namespace n2w_test;
+
+struct inline_echo_handler : not_found_handler {
+  struct websocket_handler_type : echo_calls {
+    bool runs_inline(const std::vector<std::uint8_t> &) { return true; }
+  };
+};
+
+// Sends calls one at a time and reports the median and 99th percentile of
+// their round trips.
+void measure(const char *name, unsigned short port) {
+  constexpr std::size_t calls = 20000;
+  websocket_client client{port};
+  auto &ws = client.ws;
+
+  std::vector<std::uint8_t> call(64, 0x2a);
+  boost::asio::streambuf buf;
+  std::vector<double> latencies;
+  latencies.reserve(calls);
+  for (std::size_t i = 0; i < calls; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    ws.write(buffer(call));
+    ws.read(buf);
+    buf.consume(buf.size());
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    latencies.push_back(elapsed.count());
+  }
+  std::sort(begin(latencies), end(latencies));
+  std::cout << name << ": p50 " << latencies[calls / 2] << " us, p99 "
+            << latencies[calls * 99 / 100] << " us\n";
+  ws.close(websocket::close_code::normal);
+}
+
+int main(int, char **) {
+  quiet_log();
+
+  io_service service;
+  n2w::accept<echo_handler>(service, ip::address::from_string("127.0.0.1"),
+                            9012);
+  n2w::accept<inline_echo_handler>(
+      service, ip::address::from_string("127.0.0.1"), 9013);
+  server_threads threads{service, at_least(1)};
+
+  measure("spawned", 9012);
+  measure("inline", 9013);
+  return 0;
+}
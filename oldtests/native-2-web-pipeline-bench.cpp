@@ -0,0 +1,61 @@
+#include "native-2-web-test-server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+using namespace n2w_test;
+
+static std::atomic_size_t calls{0};
+static std::atomic_size_t wakeups{0};
+static std::atomic_size_t writes{0};
+
+struct counting_echo_handler : not_found_handler {
+  struct websocket_handler_type {
+    std::vector<std::uint8_t> operator()(std::vector<std::uint8_t> message) {
+      ++calls;
+      return message;
+    }
+  };
+
+  void report_wakeup(std::chrono::system_clock::time_point) { ++wakeups; }
+  void report_write(std::size_t) { ++writes; }
+};
+
+int main(int, char **) {
+  constexpr std::size_t pipelined = 1000;
+  constexpr unsigned short port = 9011;
+  quiet_log();
+
+  io_service service;
+  n2w::accept<counting_echo_handler>(
+      service, ip::address::from_string("127.0.0.1"), port);
+  server_threads threads{service, at_least(1)};
+
+  websocket_client client{port};
+  auto &ws = client.ws;
+
+  std::vector<std::uint8_t> call(64, 0x2a);
+  boost::asio::streambuf buf;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < pipelined; ++i)
+    ws.write(buffer(call));
+  for (std::size_t i = 0; i < pipelined; ++i) {
+    ws.read(buf);
+    buf.consume(buf.size());
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << pipelined << " pipelined calls on one websocket: "
+            << elapsed.count() << " ms, " << calls << " calls, " << wakeups
+            << " writer wakeups, "
+            << static_cast<double>(wakeups) / pipelined
+            << " wakeups per response, " << writes << " writes, "
+            << static_cast<double>(writes) / pipelined
+            << " writes per response\n";
+
+  ws.close(websocket::close_code::normal);
+  return 0;
+}
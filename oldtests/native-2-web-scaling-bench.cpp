@@ -0,0 +1,61 @@
+#include "native-2-web-test-server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+using namespace n2w_test;
+
+// Keeps a call in flight on a websocket until stop is set, counting the
+// round trips.
+void call(unsigned short port, const std::atomic_bool &stop,
+          std::atomic_size_t &calls) {
+  websocket_client client{port};
+  auto &ws = client.ws;
+
+  std::vector<std::uint8_t> message(64, 0x2a);
+  boost::asio::streambuf buf;
+  std::size_t count = 0;
+  for (; !stop; ++count) {
+    ws.write(buffer(message));
+    ws.read(buf);
+    buf.consume(buf.size());
+  }
+  calls += count;
+  ws.close(websocket::close_code::normal);
+}
+
+// Serves echo calls from an io_pool of n threads and reports the calls per
+// second over all of them and per thread. Clients run two per server thread
+// on the same machine, so the figures are only comparable with each other.
+void measure(unsigned n) {
+  constexpr auto duration = std::chrono::seconds{2};
+  auto port = static_cast<unsigned short>(9020 + n);
+  n2w::io_pool pool{n};
+  n2w::accept<echo_handler>(pool, ip::address::from_string("127.0.0.1"),
+                            port);
+  pool.start([](io_service &service) { service.run(); });
+  wait_for_listeners();
+
+  std::atomic_bool stop{false};
+  std::atomic_size_t calls{0};
+  std::vector<std::thread> clients;
+  for (auto i = 2 * n; i--;)
+    clients.emplace_back(call, port, std::cref(stop), std::ref(calls));
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  for (auto &t : clients)
+    t.join();
+
+  auto per_second = calls / std::chrono::duration<double>(duration).count();
+  std::cout << n << " threads: " << per_second << " calls/s, "
+            << per_second / n << " calls/s per thread\n";
+}
+
+int main(int, char **) {
+  quiet_log();
+
+  for (auto n = 1u; n <= at_least(1); ++n)
+    measure(n);
+  return 0;
+}
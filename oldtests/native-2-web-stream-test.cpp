@@ -0,0 +1,141 @@
+#include "native-2-web-test-server.hpp"
+
+#include <native-2-web-plugin.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <tuple>
+
+using namespace n2w_test;
+
+n2w::worker_pool workers{2};
+n2w::plugin services;
+std::atomic_size_t peak{0};
+std::atomic_int pauses{0};
+
+// Serves the plugin's one service as id 0, on the test's workers.
+struct plugin_calls : n2w::call_protocol<plugin_calls> {
+  n2w::call_target service(std::uint32_t id) {
+    if (id != 0)
+      return {};
+    auto pointer = services.get_services().front();
+    return {nullptr, &services.get_function(pointer).get(),
+            services.get_stream_function(pointer),
+            services.get_placement(pointer)};
+  }
+
+  n2w::worker_pool *worker(const std::vector<std::uint8_t> &message) {
+    return find_service(message).where == n2w::placement::worker ? &workers
+                                                                 : nullptr;
+  }
+};
+
+struct plugin_handler : not_found_handler {
+  using websocket_handler_type = plugin_calls;
+
+  void report_pause(std::chrono::system_clock::time_point) { ++pauses; }
+};
+
+// Reads the stream slowly and returns the bytes read and their sum.
+std::tuple<std::uint64_t, std::uint64_t> slow_sum(std::uint32_t pause_ms,
+                                                  n2w::byte_source &source) {
+  std::uint64_t read = 0, sum = 0;
+  std::vector<std::uint8_t> data(64 << 10);
+  while (auto n = source.read_some(data.data(), data.size())) {
+    for (auto seen = peak.load();
+         n2w::connection_memory::streamed_arguments > seen;)
+      peak.compare_exchange_weak(seen,
+                                 n2w::connection_memory::streamed_arguments);
+    for (std::size_t i = 0; i < n; ++i)
+      sum += data[i];
+    read += n;
+    std::this_thread::sleep_for(std::chrono::milliseconds{pause_ms});
+  }
+  return {read, sum};
+}
+
+// The call opening a stream of length bytes to service 0.
+std::vector<std::uint8_t> open_stream(std::uint32_t id, std::uint64_t length) {
+  auto args = std::make_tuple(std::uint32_t{1});
+  std::vector<std::uint8_t> open(plugin_calls::stream_header +
+                                 n2w::serialized_size(args));
+  n2w::serialize(std::make_tuple(id, std::uint32_t{0}, length), open.data());
+  n2w::serialize(args, open.data() + plugin_calls::stream_header);
+  return open;
+}
+
+// Streams an argument several times the size of the stream window to a
+// service that reads it slowly, through the calls the server takes, and
+// checks that it arrives whole while the server holds no more than about a
+// window of it. A second stream, which would take the last worker, is
+// refused.
+int main(int, char **) {
+  quiet_log();
+  constexpr std::size_t window = 1 << 20, chunk_size = 64 << 10;
+  constexpr std::uint64_t length = 16 << 20;
+  constexpr std::uint32_t id = 7, refused_id = 8;
+  n2w::flow_limits::max_streamed_bytes = window;
+  services.register_stream_service("slow_sum", slow_sum, "");
+
+  io_service service;
+  n2w::accept<plugin_handler>(service, ip::address::from_string("127.0.0.1"),
+                              9017);
+  server_threads threads{service, at_least(2)};
+
+  websocket_client client{9017};
+  auto &ws = client.ws;
+
+  ws.write(buffer(open_stream(id, length)));
+  ws.write(buffer(open_stream(refused_id, length)));
+
+  std::uint64_t sum = 0;
+  constexpr auto header = plugin_calls::call_header;
+  std::vector<std::uint8_t> message(header + chunk_size);
+  n2w::serialize(std::make_tuple(id, plugin_calls::stream_chunk_id),
+                 message.data());
+  for (std::uint64_t sent = 0; sent < length; sent += chunk_size) {
+    for (std::size_t i = 0; i < chunk_size; ++i)
+      sum += message[header + i] = static_cast<std::uint8_t>(sent / 7 + i);
+    ws.write(buffer(message));
+  }
+
+  std::uint32_t status = plugin_calls::unknown_service,
+                refusal = plugin_calls::unknown_service;
+  std::tuple<std::uint64_t, std::uint64_t> result{};
+  for (auto replies = 2; replies--;) {
+    boost::asio::streambuf buf;
+    ws.read(buf);
+    std::vector<std::uint8_t> reply(buffer_size(buf.data()));
+    buffer_copy(buffer(reply), buf.data());
+    std::uint32_t reply_id = 0, reply_status = 0;
+    if (reply.size() < plugin_calls::reply_header)
+      break;
+    n2w::deserialize(reply.data(), reply_id);
+    n2w::deserialize(reply.data() + sizeof(reply_id), reply_status);
+    if (reply_id == refused_id) {
+      refusal = reply_status;
+    } else if (reply_id == id) {
+      status = reply_status;
+      if (reply.size() ==
+          plugin_calls::reply_header + n2w::serialized_size(result))
+        n2w::deserialize(reply.data() + plugin_calls::reply_header, result);
+    }
+  }
+  ws.close(websocket::close_code::normal);
+
+  auto[read, read_sum] = result;
+  std::cout << "Bytes streamed: " << length << ", read: " << read << '\n'
+            << "Sums match: " << (sum == read_sum ? "yes" : "no") << '\n'
+            << "Most bytes held: " << peak << " of a " << window
+            << " byte window\n"
+            << "Read pauses: " << pauses << '\n'
+            << "Second stream refused: "
+            << (refusal == plugin_calls::busy ? "yes" : "no") << '\n';
+
+  auto passed = status == plugin_calls::ok && read == length &&
+                sum == read_sum && peak <= window + chunk_size && pauses > 0 &&
+                refusal == plugin_calls::busy;
+  std::cout << (passed ? "Passed\n" : "Failed\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Streams a Blob through create_stream_service to a websocket that answers
+// as the server would, and checks the messages sent: the call with the
+// length ahead of the other arguments, then chunks led by the request id and
+// 0xffffffff that join up into the Blob. A second stream, refused busy after
+// its first chunk, must send no more of them. Run with node.
+const fs = require('fs');
+const path = require('path');
+const vm = require('vm');
+
+vm.runInThisContext(
+    fs.readFileSync(path.join(__dirname, '..', 'native-2-web.js'), 'utf8'));
+
+// A websocket whose messages sent are kept, and which calls on_send with
+// each so that the test can answer it.
+function fake_websocket(on_send) {
+  let listeners = [];
+  let ws = {
+    bufferedAmount : 0,
+    sent : [],
+    addEventListener : (type, listener) => listeners.push(listener),
+    reply : (data) => listeners.forEach(listener => listener({data})),
+    send : (data) => {
+      ws.sent.push(data);
+      on_send(ws, ws.sent.length - 1);
+    }
+  };
+  return ws;
+}
+
+async function bytes(message) {
+  return new Uint8Array(message instanceof Blob ? await message.arrayBuffer()
+                                                : message);
+}
+
+function reply_header(id, status) {
+  let reply = new DataView(new ArrayBuffer(8));
+  reply.setUint32(0, id, true);
+  reply.setUint32(4, status, true);
+  return reply.buffer;
+}
+
+const service = 5;
+const writer = args => write_number(args[0], 'setUint32');
+const reader = (data, offset) => [ data.getUint32(offset, true), offset + 4 ];
+
+// Feeds the call, then replies with the bytes received once they are all in.
+async function streams_whole() {
+  let data = new Uint8Array(3 * (1 << 16) + 123);
+  for (let i = 0; i < data.length; ++i)
+    data[i] = (i * 7) % 251;
+  let ws = fake_websocket((ws, index) => {
+    if (ws.sent.length == 1 + Math.ceil(data.length / (1 << 16)))
+      ws.reply(concat_buffer(reply_header(0, 0),
+                             write_number(data.length, 'setUint32')));
+  });
+  let result = await new Promise(
+      (resolve, reject) =>
+          create_stream_service(service, writer, reader)(ws, 42,
+                                                         new Blob([ data ]))
+              .then(resolve, reject));
+
+  let call = new DataView((await bytes(ws.sent[0])).buffer);
+  let failures = [];
+  if (call.byteLength != 8 + 8 + 4 || call.getUint32(0, true) != 0 ||
+      call.getUint32(4, true) != service ||
+      call.getUint32(8, true) != data.length || call.getUint32(12, true) != 0 ||
+      call.getUint32(16, true) != 42)
+    failures.push('call header');
+
+  let received = [];
+  for (let message of ws.sent.slice(1)) {
+    let chunk = await bytes(message);
+    let header = new DataView(chunk.buffer, 0, 8);
+    if (header.getUint32(0, true) != 0 ||
+        header.getUint32(4, true) != 0xffffffff)
+      failures.push('chunk header');
+    received.push(...chunk.slice(8));
+  }
+  if (received.length != data.length ||
+      received.some((byte, i) => byte != data[i]))
+    failures.push('chunks');
+  if (result != data.length)
+    failures.push('result');
+  console.log('Streamed ' + received.length + ' of ' + data.length +
+              ' bytes in ' + (ws.sent.length - 1) + ' chunks');
+  return failures;
+}
+
+// Answers busy upon the first chunk, as the server does a stream that finds
+// no worker.
+async function stops_when_refused() {
+  let data = new Uint8Array(8 * (1 << 16));
+  let ws = fake_websocket((ws, index) => {
+    if (index == 1)
+      ws.reply(reply_header(0, 4));
+  });
+  let status = await new Promise(
+      (resolve) => create_stream_service(service, writer, reader)(
+                       ws, 1, new Blob([ data ])).then(() => resolve(0),
+                                                       resolve));
+  console.log('Refused with status ' + status + ' after ' +
+              (ws.sent.length - 1) + ' of 8 chunks');
+  return status == 4 && ws.sent.length == 2 ? [] : [ 'refusal' ];
+}
+
+(async function() {
+  let failures = [...await streams_whole(), ...await stops_when_refused() ];
+  console.log(failures.length ? 'Failed: ' + failures.join(', ') : 'Passed');
+  process.exitCode = failures.length ? 1 : 0;
+})();
@@ -0,0 +1,93 @@
+#ifndef _NATIVE_2_WEB_TEST_SERVER_HPP_
+#define _NATIVE_2_WEB_TEST_SERVER_HPP_
+
+// What the tests and benches that serve websockets from their own process
+// share: handlers to build theirs from, the threads running the server and
+// a client websocket to call it on.
+
+#include <native-2-web-connection.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace n2w_test {
+using namespace boost::asio;
+using namespace beast;
+
+// Answers every HTTP request with 404. Test handlers derive from it and add
+// their websocket_handler_type and the reports they count.
+struct not_found_handler {
+  http::response<http::string_body>
+  operator()(const http::request<http::string_body> &request) {
+    http::response<http::string_body> response;
+    response.version = request.version;
+    response.result(404);
+    response.reason("Not Found");
+    return response;
+  }
+};
+
+// Replies to every call with the call itself.
+struct echo_calls {
+  std::vector<std::uint8_t> operator()(std::vector<std::uint8_t> message) {
+    return message;
+  }
+};
+
+struct echo_handler : not_found_handler {
+  using websocket_handler_type = echo_calls;
+};
+
+// The server's connections log every step; the figures are all the tests
+// print.
+inline void quiet_log() { std::clog.rdbuf(nullptr); }
+
+// At least n threads, or one per cpu.
+inline unsigned at_least(unsigned n) {
+  return std::max(n, std::thread::hardware_concurrency());
+}
+
+// Gives listeners just started the moment they need to accept.
+inline void wait_for_listeners() {
+  std::this_thread::sleep_for(std::chrono::milliseconds{100});
+}
+
+// Runs an io_service on some threads until it goes out of scope.
+class server_threads {
+  io_service &service;
+  io_service::work work;
+  std::vector<std::thread> threads;
+
+public:
+  server_threads(io_service &service, unsigned count)
+      : service{service}, work{service} {
+    while (count--)
+      threads.emplace_back([&service]() { service.run(); });
+    wait_for_listeners();
+  }
+  ~server_threads() {
+    service.stop();
+    for (auto &t : threads)
+      t.join();
+  }
+};
+
+// A websocket upgraded from a connection to a server on this host, sending
+// binary messages.
+struct websocket_client {
+  io_service service;
+  ip::tcp::socket socket{service};
+  websocket::stream<ip::tcp::socket &> ws{socket};
+
+  explicit websocket_client(unsigned short port) {
+    socket.connect({ip::address::from_string("127.0.0.1"), port});
+    ws.handshake("127.0.0.1", "/");
+    ws.binary(true);
+  }
+};
+} // namespace n2w_test
+#endif
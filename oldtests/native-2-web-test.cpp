@@ -98,6 +98,13 @@ int main(int, char **) {
   std::cout << std::boolalpha << (j == end(ustr)) << ' ' << ustr.size() << ' '
             << std::distance(begin(ustr), j) << '\n';
 
+  constexpr auto fixed_size =
+      n2w::serialized_size(std::tuple<int, double, std::array<char16_t, 3>>{});
+  std::cout << "Fixed serialized size: " << fixed_size << '\n';
+  std::cout << "Serialized size: "
+            << n2w::serialized_size(std::make_tuple(a, b, c, d, e)) << ' '
+            << ustr.size() << '\n';
+
   swap_test();
 
   std::cout << n2w::mangled<void (*)(decltype(a), decltype(b), decltype(c),
@@ -272,6 +279,8 @@ int main(int, char **) {
     n2w::deserialize(begin(buf), reconst);
     std::cout << "Reconstitution test: " << std::boolalpha
               << (fill_test == reconst) << '\n';
+    std::cout << "Serialized size test: " << std::boolalpha
+              << (n2w::serialized_size(fill_test) == buf.size()) << '\n';
     n2w::debug_print(std::cout, fill_test) << "\n\n";
     n2w::debug_print(std::cout, reconst) << "\n\n";
 
@@ -290,6 +299,49 @@ int main(int, char **) {
     std::cout << N2W__USING_STRUCTURE(test_substructure, (c)(d),
                                       string_bool)::base_names()[0]
               << '\n';
+
+    // Unordered sets come back in another order, so the columns are checked
+    // against a round trip by rows rather than against the rows they came from.
+    n2w::filler<test_substructure> fills;
+    n2w::columns<test_substructure> rows, columns_back;
+    for (auto n = 0; n < 10; ++n)
+      rows.push_back(fills());
+    std::vector<test_substructure> rows_back;
+    std::vector<uint8_t> columns_buf, rows_buf, rows_back_buf;
+    n2w::serialize(static_cast<decltype(rows_back) &>(rows),
+                   back_inserter(rows_buf));
+    n2w::deserialize(begin(rows_buf), rows_back);
+    rows_buf.clear();
+    n2w::serialize(rows_back, back_inserter(rows_buf));
+    n2w::serialize(rows, back_inserter(columns_buf));
+    n2w::deserialize(begin(columns_buf), columns_back);
+    n2w::serialize(static_cast<decltype(rows_back) &>(columns_back),
+                   back_inserter(rows_back_buf));
+    std::cout << n2w::mangled<decltype(rows)>() << '\n';
+    std::cout << "Columnar reconstitution test: " << std::boolalpha
+              << (rows_buf == rows_back_buf) << '\n';
+    std::cout << "Columnar serialized size test: " << std::boolalpha
+              << (n2w::serialized_size(rows) == columns_buf.size()) << '\n';
+  }
+
+  {
+    // Every cut short buffer must be refused instead of read past its end.
+    std::vector<std::uint8_t> buf;
+    n2w::serialize(std::make_tuple(std::string{"truncated"},
+                                   std::vector<double>(8, 1.5)),
+                   back_inserter(buf));
+    auto refused = 0u;
+    for (std::size_t size = 0; size < buf.size(); ++size) {
+      std::vector<std::uint8_t> cut(cbegin(buf), cbegin(buf) + size);
+      std::tuple<std::string_view, n2w::numbers_view<double>> args;
+      try {
+        n2w::deserialize(n2w::bounded_input{cut.data(), cut.size()}, args);
+      } catch (const n2w::truncated_input &) {
+        ++refused;
+      }
+    }
+    std::cout << "Truncated input test: " << std::boolalpha
+              << (refused == buf.size()) << '\n';
   }
 
   return 0;
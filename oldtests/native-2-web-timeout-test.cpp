@@ -0,0 +1,106 @@
+#include "native-2-web-test-server.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+using namespace n2w_test;
+
+std::array<std::atomic_int, 4> timeouts{};
+
+struct counting_echo_handler : echo_handler {
+  void report_timeout(n2w::timeout_kind kind) {
+    ++timeouts[static_cast<int>(kind)];
+  }
+};
+
+// Reads from a socket until the server shuts it down, and returns how long
+// that took in seconds.
+double wait_for_shutdown(ip::tcp::socket &socket) {
+  auto start = std::chrono::steady_clock::now();
+  boost::system::error_code ec;
+  std::array<char, 4096> data;
+  while (!ec)
+    socket.read_some(buffer(data), ec);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Has a client stall at each step a server connection times out on, and
+// checks that the server shuts it down and counts the timeout.
+int main(int, char **) {
+  quiet_log();
+  constexpr auto port = 9015;
+  n2w::connection_timeouts::handshake = std::chrono::seconds{1};
+  n2w::connection_timeouts::idle = std::chrono::seconds{1};
+  n2w::connection_timeouts::read = std::chrono::seconds{1};
+  n2w::connection_timeouts::write = std::chrono::seconds{1};
+
+  io_service service;
+  n2w::accept<counting_echo_handler>(
+      service, ip::address::from_string("127.0.0.1"), port);
+  server_threads threads{service, at_least(2)};
+
+  io_service client_service;
+  ip::tcp::endpoint server{ip::address::from_string("127.0.0.1"), port};
+  auto passed = true;
+  auto check = [&passed](const char *step, double seconds,
+                         n2w::timeout_kind kind) {
+    auto counted = timeouts[static_cast<int>(kind)].load();
+    auto ok = seconds > 0.5 && seconds < 5 && counted == 1;
+    std::cout << step << ": shut down after " << seconds << " s, counted "
+              << counted << (ok ? "\n" : " Failed\n");
+    passed = passed && ok;
+  };
+
+  {
+    ip::tcp::socket socket{client_service};
+    socket.connect(server);
+    write(socket, buffer(std::string{"GET / HTTP/1.1\r\nHost:"}));
+    check("Handshake", wait_for_shutdown(socket),
+          n2w::timeout_kind::handshake);
+  }
+
+  {
+    ip::tcp::socket socket{client_service};
+    socket.connect(server);
+    write(socket, buffer(std::string{"GET / HTTP/1.1\r\nHost: n2w\r\n\r\n"}));
+    boost::asio::streambuf response;
+    read_until(socket, response, "\r\n\r\n");
+    write(socket, buffer(std::string{"GET / HTTP/1.1\r\nHost:"}));
+    check("Read", wait_for_shutdown(socket), n2w::timeout_kind::read);
+  }
+
+  {
+    websocket_client client{port};
+    auto start = std::chrono::steady_clock::now();
+    boost::system::error_code ec;
+    boost::asio::streambuf buf;
+    client.ws.read(buf, ec);
+    check("Idle",
+          std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                        start)
+              .count(),
+          n2w::timeout_kind::idle);
+    std::cout << "Idle websocket closed: " << ec.message() << '\n';
+  }
+
+  {
+    websocket_client client{port};
+    std::vector<std::uint8_t> call(1 << 20, 0x2a);
+    auto start = std::chrono::steady_clock::now();
+    boost::system::error_code ec;
+    for (auto i = 0; i < 64 && !ec; ++i)
+      client.ws.write(buffer(call), ec);
+    check("Write",
+          std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                        start)
+              .count(),
+          n2w::timeout_kind::write);
+  }
+
+  std::cout << (passed ? "Passed\n" : "Failed\n");
+  return passed ? 0 : 1;
+}